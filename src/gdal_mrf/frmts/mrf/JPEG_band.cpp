@@ -231,11 +231,13 @@ CPLErr JPEG_Codec::CompressJPEG(buf_mgr &dst, buf_mgr &src)
 * @param data pointer to output buffer
 * @param png pointer to PNG in memory
 * @param sz if non-zero, test that uncompressed data fits in the buffer.
+* @param denom reduction factor, 1, 2, 4 or 8. The page is decoded at a lower resolution
+*  by libjpeg, skipping most of the IDCT work
 */
 #if defined(JPEG12_ON)
-CPLErr JPEG_Codec::DecompressJPEG12(buf_mgr &dst, buf_mgr &isrc)
+CPLErr JPEG_Codec::DecompressJPEG12(buf_mgr &dst, buf_mgr &isrc, int denom)
 #else
-CPLErr JPEG_Codec::DecompressJPEG(buf_mgr &dst, buf_mgr &isrc)
+CPLErr JPEG_Codec::DecompressJPEG(buf_mgr &dst, buf_mgr &isrc, int denom)
 #endif
 
 {
@@ -275,6 +277,10 @@ CPLErr JPEG_Codec::DecompressJPEG(buf_mgr &dst, buf_mgr &isrc)
     // Use float, it is actually faster than the ISLOW method by a tiny bit
     cinfo.dct_method = JDCT_FLOAT;
 
+    // Reduced resolution decoding
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+
     //
     // Tolerate different input if we can do the conversion
     // Gray and RGB for example
@@ -286,22 +292,23 @@ CPLErr JPEG_Codec::DecompressJPEG(buf_mgr &dst, buf_mgr &isrc)
     if (nbands == 1 && cinfo.num_components != nbands)
         cinfo.out_color_space = JCS_GRAYSCALE;
 
-    int linesize = cinfo.image_width * nbands * ((cinfo.data_precision == 8) ? 1 : 2);
-
     jpeg_start_decompress(&cinfo);
 
+    // The output size is known after the decompression starts
+    int linesize = cinfo.output_width * nbands * ((cinfo.data_precision == 8) ? 1 : 2);
+
     // We have a mismatch between the real and the declared data format
     // warn and fail if output buffer is too small
-    if (linesize*cinfo.image_height != dst.size) {
+    if (linesize*cinfo.output_height != dst.size) {
         CPLError(CE_Warning, CPLE_AppDefined, "MRF: read JPEG size is wrong");
-        if (linesize*cinfo.image_height > dst.size) {
+        if (linesize*cinfo.output_height > dst.size) {
             CPLError(CE_Failure, CPLE_AppDefined, "MRF: JPEG decompress buffer overflow");
             jpeg_destroy_decompress(&cinfo);
             return CE_Failure;
         }
     }
     // Decompress, two lines at a time is what libjpeg does
-    while (cinfo.output_scanline < cinfo.image_height) {
+    while (cinfo.output_scanline < cinfo.output_height) {
         char *rp[2];
         rp[0] = (char *)dst.buffer + linesize*cinfo.output_scanline;
         rp[1] = rp[0] + linesize;
@@ -327,6 +334,15 @@ CPLErr JPEG_Band::Decompress(buf_mgr &dst, buf_mgr &src)
     return codec.DecompressJPEG(dst, src);
 }
 
+CPLErr JPEG_Band::DecompressReduced(buf_mgr &dst, buf_mgr &src, int denom)
+{
+#if defined(LIBJPEG_12_H)
+    if (GDT_Byte != img.dt)
+        return codec.DecompressJPEG12(dst, src, denom);
+#endif
+    return codec.DecompressJPEG(dst, src, denom);
+}
+
 CPLErr JPEG_Band::Compress(buf_mgr &dst, buf_mgr &src)
 {
 #if defined(LIBJPEG_12_H)
@@ -99,7 +99,31 @@ static CPLErr initBuffer(buf_mgr &b)
     return CE_Failure;
 }
 
+// Box average of interleaved bytes, by denom in both directions, safe to use in place
+static void BoxReduce(const GByte *src, GByte *dst, int xsz, int ysz, int c, int denom)
+{
+    const int osz_x = xsz / denom, osz_y = ysz / denom;
+    const int area = denom * denom;
+    for (int y = 0; y < osz_y; y++)
+        for (int x = 0; x < osz_x; x++)
+            for (int b = 0; b < c; b++) {
+                int acc = area / 2;
+                for (int j = 0; j < denom; j++) {
+                    const GByte *s = src + ((y * denom + j) * xsz + x * denom) * c + b;
+                    for (int i = 0; i < denom; i++, s += c)
+                        acc += *s;
+                }
+                *dst++ = static_cast<GByte>(acc / area);
+            }
+}
+
 CPLErr JPNG_Band::Decompress(buf_mgr &dst, buf_mgr &src)
+{
+    return DecompressReduced(dst, src, 1);
+}
+
+// JPEG pages are decoded at reduced resolution, PNG pages are decoded at full resolution then averaged
+CPLErr JPNG_Band::DecompressReduced(buf_mgr &dst, buf_mgr &src, int denom)
 {
     CPLErr retval = CE_None;
 
@@ -119,7 +143,7 @@ CPLErr JPNG_Band::Decompress(buf_mgr &dst, buf_mgr &src)
         buf_mgr temp = dst; // dst still owns the storage
         temp.size = (image.pagesize.c == 3) ? dst.size / 4 * 3 : dst.size / 2;
 
-        retval = codec.DecompressJPEG(temp, src);
+        retval = codec.DecompressJPEG(temp, src, denom);
         if (CE_None == retval) { // add opaque alpha, in place
             if (image.pagesize.c == 3)
                 RGB2RGBA(dst.buffer, dst.buffer + dst.size, temp.buffer + temp.size);
@@ -131,7 +155,18 @@ CPLErr JPNG_Band::Decompress(buf_mgr &dst, buf_mgr &src)
         assert(PNG_SIG == CPL_LSBWORD32(signature));
         PNG_Codec codec(image);
         // PNG codec expands to 4 bands
-        return codec.DecompressPNG(dst, src);
+        if (1 == denom)
+            return codec.DecompressPNG(dst, src);
+
+        buf_mgr temp = { NULL, static_cast<size_t>(img.pageSizeBytes) };
+        retval = initBuffer(temp);
+        if (retval != CE_None)
+            return retval;
+        retval = codec.DecompressPNG(temp, src);
+        if (CE_None == retval)
+            BoxReduce(reinterpret_cast<GByte *>(temp.buffer), reinterpret_cast<GByte *>(dst.buffer),
+                img.pagesize.x, img.pagesize.y, img.pagesize.c, denom);
+        CPLFree(temp.buffer);
     }
 
     return retval;
@@ -52,6 +52,10 @@
 #include <gdal_pam.h>
 #include <ogr_srs_api.h>
 #include <ogr_spatialref.h>
+#include <cpl_multiproc.h>
+#include <deque>
+#include <map>
+#include <set>
 
 // For printing values
 #include <ostream>
@@ -82,6 +86,13 @@ NAMESPACE_MRF_START
 //
 #define ZFLAG_SMASK 0x1c0
 
+// Maximum number of tiles per side fetched in a single source read by a caching MRF
+#define MAX_FETCH_REGION 8
+// Tile offset used to record a source open failure in the negative cache
+#define SOURCE_FAILURE (~GUIntBig(0))
+// Size of the source index reads when cloning it in the background, a multiple of 16
+#define CLONE_CHUNK (1024 * 1024)
+
 // Force LERC to be included, normally off, detected in the makefile
 // #define LERC
 
@@ -115,6 +126,14 @@ typedef struct {
     GIntBig size;
 } ILIdx;
 
+// A delta version record, the tile index record at infooffset as it was in that version
+// Stored after the current index, for versioned="delta" MRFs, big endian
+typedef struct {
+    GIntBig version;
+    GIntBig infooffset;
+    ILIdx idx;
+} ILDelta;
+
 // Size of an image, also used as a tile or pixel location
 struct ILSize {
     GInt32 x, y, z, c;
@@ -239,6 +258,13 @@ CPLXMLNode *XMLSetAttributeVal(CPLXMLNode *parent,
     const char*pszName, const ILSize &sz, const char *frmt = NULL);
 void XMLSetAttributeVal(CPLXMLNode *parent,
     const char*pszName, std::vector<double> const &values);
+// Boolean option value test
+#if GDAL_VERSION_MAJOR >= 2
+#define BOOLTEST CPLTestBool
+#else
+#define BOOLTEST CSLTestBoolean
+#endif
+
 //
 // Extension to CSL, set an entry only if it doesn't already exist
 //
@@ -281,10 +307,20 @@ typedef struct {
 // Offset of index, pos is in pages
 GIntBig IdxOffset(const ILSize &pos, const ILImage &img);
 
-enum { SAMPLING_ERR, SAMPLING_Avg, SAMPLING_Near };
+enum { SAMPLING_ERR, SAMPLING_Avg, SAMPLING_Near, SAMPLING_Linear, SAMPLING_Cubic, SAMPLING_Mode, SAMPLING_DCT };
+// Internal sampling mode for a GDAL resampling name, SAMPLING_ERR if not handled internally
+int SamplingMode(const char *pszResampling);
 
 GDALMRFRasterBand *newMRFRasterBand(GDALMRFDataset *, const ILImage &, int, int level = 0);
 
+// A fetched page waiting to be stored by the write behind thread
+struct WBPage {
+    GDALMRFRasterBand *band;
+    GUIntBig infooffset;
+    void *data;
+    size_t size;
+};
+
 class GDALMRFDataset : public GDALPamDataset {
     friend class GDALMRFRasterBand;
     friend GDALMRFRasterBand *newMRFRasterBand(GDALMRFDataset *, const ILImage &, int, int level);
@@ -339,6 +375,39 @@ public:
     virtual CPLErr PatchOverview(int BlockX, int BlockY, int Width, int Height,
         int srcLevel = 0, int recursive = false, int sampling_mode = SAMPLING_Avg);
 
+    // Regenerates the overview tiles affected by the writes tracked in this slice
+    CPLErr RefreshOverviews(int sampling_mode = SAMPLING_Avg);
+
+    // Dataset level free-form options, config options are used as defaults
+    const char *GetOptionValue(const char *opt, const char *def) const;
+
+    // For cloning MRFs, copy all the tiles not yet cloned, in source data file order
+    // The source is read in chunks of up to the given size, the counts are returned if requested
+    CPLErr SyncClone(GIntBig chunk, GDALProgressFunc pfnProgress, void *pProgressData,
+        GIntBig *pnTiles = NULL, GIntBig *pnBytes = NULL);
+
+    // For caching and cloned MRFs, is the tile in the local cache, either stored or checked empty
+    // Returns 1 if it is, 0 if it is not and -1 on error
+    int TileCached(int nBand, int level, int x, int y);
+
+    // For versioned MRFs, the number of versions kept, not counting the current one
+    int GetVersionCount() const { return verCount; }
+
+    // For versioned MRFs, the tiles with different index records in two versions, 0 being
+    // the current one.  The tile level is in l, the records of the newer version in native order
+    CPLErr ChangedTiles(int v1, int v2, std::vector<ILSize> &tiles, std::vector<ILIdx> *records = NULL);
+
+    // For versioned MRFs opened in update mode, drop all but the last keep versions, then rewrite
+    // the data file with only the tiles still used.  Returns the number of data bytes reclaimed
+    CPLErr PruneVersions(int keep, GDALProgressFunc pfnProgress, void *pProgressData,
+        GIntBig *pnBytes = NULL);
+
+    // For third dimension MRFs, read the same window of one band from nZCount slices starting
+    // at nZOff, in one call. The buffer receives the slices one after the other, each one
+    // nXSize by nYSize values of eBufType. Only for the full resolution of local MRFs
+    CPLErr ReadZStack(int nBand, int nXOff, int nYOff, int nXSize, int nYSize,
+        int nZOff, int nZCount, void *pData, GDALDataType eBufType);
+
     // Creates an XML tree from the current MRF.  If written to a file it becomes an MRF
     CPLXMLNode *BuildConfig();
 
@@ -396,13 +465,106 @@ protected:
     // Write a tile, the infooffset is the relative position in the index file
     virtual CPLErr WriteTile(void *buff, GUIntBig infooffset, GUIntBig size = 0);
 
+    // Builds the overview pages directly from the source level pages, all bands at once
+    CPLErr PatchPages(int BlockXOut, int BlockYOut, int WidthOut, int HeightOut,
+        int srcLevel, int sampling_mode);
+    // Builds one or more overview levels from a single reduced resolution decoding of the base level pages
+    CPLErr PatchPagesDCT(int BlockXOut, int BlockYOut, int WidthOut, int HeightOut,
+        int baseLevel, int k0, int k1, bool dirtyOnly = false);
+    // Number of levels PatchPagesDCT can build in one pass from a source level, zero if none
+    int DCTGroupSize(int srcLevel, int sampling_mode);
+    // Builds an overview page from the level below, through the bands
+    CPLErr SynthesizePage(GDALMRFRasterBand *b, int xblk, int yblk, void *page, int sampling_mode);
+    // Sampling mode used to synthesize missing overview tiles, SAMPLING_ERR if off
+    int SynthMode() const;
+    // Should the synthesized overview tiles be stored
+    int SynthPersist() const;
+    // Sampling mode used by caching MRFs to build overview tiles from cached ones, SAMPLING_ERR if off
+    int CacheOverviewMode() const;
+    // Z delta coding, the key slice interval, and the key slice of a slice or -1
+    int ZDeltaInterval() const;
+    int ZDeltaKey(int z = -1) const;
+
+    // Dirty tile tracking, one bit per tile per level, persisted in a sidecar file
+    bool InitDirty();
+    GIntBig DirtyBit(int x, int y, int l);
+    void MarkDirty(int x, int y, int l);
+    bool IsDirty(int x, int y, int l);
+    void ClearDirty(int l);
+
     // For versioned MRFs, add a version
     CPLErr AddVersion();
+    // Delta versions, read the version records and save the record of a tile about to change
+    CPLErr ReadDeltas(int version);
+    CPLErr SaveDelta(GUIntBig infooffset, const ILIdx &tinfo);
+
+    // Single flight cache fills, only one fetch of a tile is in progress within the process
+    // ClaimFetch returns false if another fetch is in progress, after waiting for it if requested
+    bool ClaimFetch(GUIntBig infooffset, bool wait = true);
+    void ReleaseFetch(GUIntBig infooffset);
+    // Cross process fetch lock, enabled by the FETCH_LOCK_WAIT option. Returns false if
+    // another process holds the lock. The lock handle is NULL if locking is not enabled
+    bool LockFetch(GUIntBig infooffset, void **phLock, bool wait = true);
+    static void UnlockFetch(void *hLock);
+
+    // Bounded caching MRF, see mrf_cache.cpp
+    GIntBig CacheMaxSize();
+    VSILFILE *AtimeFP();
+    void TouchTile(GUIntBig infooffset);
+    void FlushAtimes();
+    void CacheStored(GIntBig size);
+    CPLErr EvictTiles();
+    // Admission policy, should the tile be stored in the cache. Counts the request if asked
+    bool AdmitTile(GUIntBig infooffset, bool count = true);
+    void SaveAdmit();
+
+    // Negative cache of source failures, tiles and source open, with a time to live
+    // FetchFailed is true during the FETCH_FAIL_TTL interval after a failure
+    bool FetchFailed(GUIntBig infooffset);
+    void FetchFailure(GUIntBig infooffset);
+    void SaveFailures();
+
+    // Write behind, the fetched pages are stored by a separate thread
+    // QueuePage returns false if write behind is not enabled
+    bool QueuePage(GDALMRFRasterBand *band, GUIntBig infooffset, const void *page);
+    // Copy a page waiting to be written, returns false if not queued, buffer can be NULL
+    bool PendingPage(GUIntBig infooffset, void *buffer);
+    void WriteBehind();
+    void StopWriteBehind();
+    static void WriteBehindThread(void *);
+    // Cloned MRF, copy a tile between local data files without reading it, if enabled
+    // Returns CE_Failure if not possible, the tile has to be copied through memory
+    CPLErr CopyClonedTile(GDALMRFDataset *pSrc, const ILIdx &tinfo, GUIntBig infooffset);
+    void CloseClonedCopy();
+    // Cloned MRF, copy the source index in a background thread, enabled by CLONE_INDEX
+    void StartCloneIndex();
+    void CloneIndex();
+    static void CloneIndexThread(void *);
+    // Fetch the missing tiles of a read window in parallel, before reading it
+    void PrefetchTiles(int nXOff, int nYOff, int nXSize, int nYSize, int nBandCount, int *panBandMap);
+    static void PrefetchThread(void *);
+    // Pool of source dataset instances used by the fetch threads
+    GDALDataset *TakeSrcDS();
+    void ReturnSrcDS(GDALDataset *poDS);
+    void CloseSrcPool();
+    // Decodes the tiles of a Z stack read
+    static void ZStackThread(void *);
+    // The file IO lock, created on first use. Always taken, since the background threads
+    // may start at any time, and it costs little compared with the file operations
+    CPLMutex **IOMutex() { return &hIOMutex; }
+    // Cross process lock on a cache, see CompactCache
+    void *LockCache(bool exclusive);
+    static void UnlockCache(void *hLock);
+public:
+    // Reclaim the data file space left by the evicted tiles
+    CPLErr CompactCache();
+protected:
 
     // Read the index record itself
     CPLErr ReadTileIdx(ILIdx &tinfo, const ILSize &pos, const ILImage &img, const GIntBig bias = 0);
 
     VSILFILE *IdxFP();
+    VSILFILE *OpenIdxFP();
     VSILFILE *DataFP();
     GDALRWFlag IdxMode() {
         if (!ifp.FP) IdxFP();
@@ -413,6 +575,8 @@ protected:
         return dfp.acc;
     };
     GDALDataset *GetSrcDS();
+    // Open the source, a separate instance if not shared
+    GDALDataset *OpenSrcDS(bool shared = true);
 
     /*
      *  There are two images defined to allow for morphing on use, in the future
@@ -441,12 +605,63 @@ protected:
     int mp_safe;      // Not thread safe, only multiple writers
     int hasVersions;  // Does it support versions
     int verCount;     // The last version
+    int deltaVersions; // Versions only hold the changed index records
+    std::set<GIntBig> verLatest; // Records already saved in the last version
+    std::map<GIntBig, ILIdx> verMap; // Records of the version being read, when not the current one
     int bCrystalized; // Unset only during the create process
     int spacing;      // How many spare bytes before each tile data
 
     // Freeform sticky dataset options, as a list of key-value pairs
     CPLStringList optlist;
 
+    // Dirty tile bitmaps for each level of the current slice, and the sidecar file
+    int trackDirty;
+    std::vector<std::vector<GByte> > dirty;
+    std::vector<GIntBig> dirtyOffset;
+    VSILFILE *dirtyFP;
+
+    // Bounded cache, maximum and current size of cached data, access times, evicted tile count
+    // The pending access times by index record number, and if a thread is evicting tiles
+    GIntBig cacheMax;
+    GIntBig cacheLive;
+    VSILFILE *atimeFP;
+    int cacheEvicted;
+    std::map<GUIntBig, GUInt32> atimes;
+    bool cacheEvicting;
+    // Cache admission, requests needed, request count sketch and last aging time
+    int cacheAdmit;
+    std::vector<GByte> admit;
+    GIntBig admitAged;
+
+    // Source failure time to live, in seconds, and if the persisted failures were loaded
+    int failTTL;
+    bool failLoaded;
+
+    // Write behind queue, in order, the pages by index record offset, their size in bytes
+    // and its limit, the thread and the locks
+    std::deque<GUIntBig> wbQueue;
+    std::map<GUIntBig, WBPage> wbPages;
+    size_t wbBytes;
+    size_t wbMax;
+    bool wbStop;
+    CPLJoinableThread *wbThread;
+    CPLMutex *hWBMutex;
+    CPLCond *hWBCond;
+    CPLMutex *hIOMutex;
+    // Source datasets for the fetch threads, not in use, and their lock
+    std::vector<GDALDataset *> srcPool;
+    CPLMutex *hSrcPoolMutex;
+    // Background index cloning, the thread, the source index name and the range to copy
+    bool cloneStarted;
+    volatile bool cloneStop;
+    CPLJoinableThread *cloneThread;
+    CPLString cloneSrcIdx;
+    GIntBig cloneFrom;
+    GIntBig cloneTo;
+    // File descriptors for the direct tile copy, -1 until opened, -2 if not available
+    int copySrcFd;
+    int copyDstFd;
+
     // If caching data, the parent dataset
     GDALDataset *poSrcDS;
 
@@ -507,8 +722,20 @@ public:
 
     // MRF specific, fetch is from a remote source
     CPLErr FetchBlock(int xblk, int yblk, void *buffer = NULL);
+    // Tiles to be fetched together with the requested one
+    void FetchRegion(GDALDataset *poSrcDS, double scl, int xblk, int yblk,
+        int &tx0, int &ty0, int &nx, int &ny);
+    // Read a region of tiles from the source, for all the bands if asked and the pages are band separate
+    CPLErr ReadSource(GDALDataset *poSrcDS, int tx0, int ty0, int nx, int ny, void *buffer,
+        bool allBands = false);
+    // Store a fetched page in the local cache
+    CPLErr CachePage(GUIntBig infooffset, void *page);
     // Fetch a block from a cloned MRF
     CPLErr FetchClonedBlock(int xblk, int yblk, void *buffer = NULL);
+    // Build a missing overview block from the level below
+    CPLErr SynthesizeBlock(int xblk, int yblk, void *buffer, int sampling_mode);
+    // Are the tiles of the level below in the cache
+    bool ChildrenCached(int xblk, int yblk);
 
     // Block not stored on disk
     CPLErr FillBlock(void *buffer);
@@ -516,6 +743,17 @@ public:
     // de-interlace a buffer in pixel blocks
     CPLErr RB(int xblk, int yblk, buf_mgr src, void *buffer);
 
+    // Read and decode a full page, all the bands if interleaved, at 1/denom resolution
+    // z is the slice of the page, the current one if negative
+    CPLErr ReadPage(const ILIdx &tinfo, void *buffer, int denom = 1, int z = -1);
+    // Encode and write a full page, bypassing the block cache
+    CPLErr WritePage(int xblk, int yblk, void *buffer);
+    // For Z delta MRFs, replace a page with its difference from the key slice page
+    // key receives the record of the key tile, size is zero if the page was not changed
+    void ZDeltaEncode(GUIntBig infooffset, void *page, ILIdx &key);
+    // Write a tile, followed by the key record if the slice is Z delta coded
+    CPLErr ZWriteTile(void *buff, GUIntBig infooffset, GUIntBig size, const ILIdx &key);
+
     const char *GetOptionValue(const char *opt, const char *def) const;
     void SetAccess(GDALAccess eA) { eAccess = eA; }
     void SetDeflate(int v) { deflatep = (v != 0); }
@@ -532,6 +770,8 @@ protected:
     ILImage img;
     std::vector<GDALMRFRasterBand *> overviews;
     int overview;
+    // Serializes the encoding in CachePage, called from the write behind and prefetch threads
+    CPLMutex *hEncodeMutex;
 
     VSILFILE *IdxFP() { return poDS->IdxFP(); }
     GDALRWFlag IdxMode() { return poDS->IdxMode(); }
@@ -550,6 +790,11 @@ protected:
     virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src) = 0;
     virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src) = 0;
 
+    // Decompression at 1/denom resolution, denom is 2, 4 or 8.  Only for formats which can
+    // do it faster than a full decompression, like JPEG
+    virtual bool CanDecompressReduced() { return false; }
+    virtual CPLErr DecompressReduced(buf_mgr &, buf_mgr &, int) { return CE_Failure; }
+
     // Read the index record itself, can be overwritten
     //    virtual CPLErr ReadTileIdx(const ILSize &, ILIdx &, GIntBig bias = 0);
 
@@ -617,12 +862,13 @@ public:
     explicit JPEG_Codec(const ILImage &image) : img(image), sameres(FALSE), rgb(FALSE), optimize(false) {};
 
     CPLErr CompressJPEG(buf_mgr &dst, buf_mgr &src);
-    CPLErr DecompressJPEG(buf_mgr &dst, buf_mgr &src);
+    // Decompress at 1/denom resolution, denom is 1, 2, 4 or 8
+    CPLErr DecompressJPEG(buf_mgr &dst, buf_mgr &src, int denom = 1);
 
 #if defined(JPEG12_SUPPORTED) // Internal only
 #define LIBJPEG_12_H "../jpeg/libjpeg12/jpeglib.h"
     CPLErr CompressJPEG12(buf_mgr &dst, buf_mgr &src);
-    CPLErr DecompressJPEG12(buf_mgr &dst, buf_mgr &src);
+    CPLErr DecompressJPEG12(buf_mgr &dst, buf_mgr &src, int denom = 1);
 #endif
 
     const ILImage img;
@@ -645,6 +891,8 @@ public:
 protected:
     virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src) override;
     virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src) override;
+    virtual bool CanDecompressReduced() override { return true; }
+    virtual CPLErr DecompressReduced(buf_mgr &dst, buf_mgr &src, int denom) override;
 
     JPEG_Codec codec;
 };
@@ -658,6 +906,8 @@ public:
 protected:
     virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src) override;
     virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src) override;
+    virtual bool CanDecompressReduced() override { return true; }
+    virtual CPLErr DecompressReduced(buf_mgr &dst, buf_mgr &src, int denom) override;
 
     CPLErr CompressJPNG(buf_mgr &dst, buf_mgr &src);
     CPLErr DecompressJPNG(buf_mgr &dst, buf_mgr &src);
@@ -54,8 +54,16 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <ctime>
+#include <set>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
 CPL_CVSID("$Id: marfa_dataset.cpp 36711 2016-12-06 00:19:18Z rouault $");
 
 using std::vector;
@@ -63,12 +71,6 @@ using std::string;
 
 NAMESPACE_MRF_START
 
-#if GDAL_VERSION_MAJOR >= 2
-#define BOOLTEST CPLTestBool
-#else
-#define BOOLTEST CSLTestBoolean
-#endif
-
 // Initialize as invalid
 GDALMRFDataset::GDALMRFDataset() :
     zslice(0),
@@ -79,8 +81,35 @@ GDALMRFDataset::GDALMRFDataset() :
     mp_safe(FALSE),
     hasVersions(FALSE),
     verCount(0),
+    deltaVersions(FALSE),
     bCrystalized(FALSE), // Assume not in create mode
     spacing(0),
+    trackDirty(-1),
+    dirtyFP(NULL),
+    cacheMax(-1),
+    cacheLive(-1),
+    atimeFP(NULL),
+    cacheEvicted(0),
+    cacheEvicting(false),
+    cacheAdmit(-1),
+    admitAged(0),
+    failTTL(-1),
+    failLoaded(false),
+    wbBytes(0),
+    wbMax(0),
+    wbStop(false),
+    wbThread(NULL),
+    hWBMutex(NULL),
+    hWBCond(NULL),
+    hIOMutex(NULL),
+    hSrcPoolMutex(NULL),
+    cloneStarted(false),
+    cloneStop(false),
+    cloneThread(NULL),
+    cloneFrom(0),
+    cloneTo(0),
+    copySrcFd(-1),
+    copyDstFd(-1),
     poSrcDS(NULL),
     level(-1),
     cds(NULL),
@@ -124,6 +153,43 @@ GDALMRFDataset::~GDALMRFDataset()
 
 {   // Make sure everything gets written
     FlushCache();
+    StopWriteBehind();
+    if (cloneThread) { // Stop the index cloning, it will resume next time
+        cloneStop = true;
+        CPLJoinThread(cloneThread);
+        cloneThread = NULL;
+    }
+
+    // Regenerate the overview tiles affected by this session, if requested
+    const char *pszRefresh = GetOptionValue("DIRTY_REFRESH", NULL);
+    if (pszRefresh && eAccess == GA_Update) {
+        int sampling = SamplingMode(pszRefresh);
+        if (sampling == SAMPLING_ERR)
+            CPLError(CE_Warning, CPLE_NotSupported,
+                "MRF: DIRTY_REFRESH sampling %s is not supported", pszRefresh);
+        else
+            RefreshOverviews(sampling);
+    }
+
+    if (dirtyFP)
+        VSIFCloseL(dirtyFP);
+
+    // Reclaim the space of the tiles evicted from a bounded cache, if asked
+    if (cacheEvicted && BOOLTEST(GetOptionValue("CACHE_COMPACT", "FALSE")))
+        CompactCache();
+    FlushAtimes();
+    if (atimeFP)
+        VSIFCloseL(atimeFP);
+    SaveAdmit();
+    SaveFailures();
+    CloseClonedCopy();
+    CloseSrcPool();
+    if (hWBCond)
+        CPLDestroyCond(hWBCond);
+    if (hWBMutex)
+        CPLDestroyMutex(hWBMutex);
+    if (hIOMutex)
+        CPLDestroyMutex(hIOMutex);
     if (ifp.FP)
         VSIFCloseL(ifp.FP);
     if (dfp.FP)
@@ -183,6 +249,10 @@ CPLErr GDALMRFDataset::IRasterIO(GDALRWFlag eRWFlag, int nXOff, int nYOff, int n
     if (!bCrystalized)
         Crystalize();
 
+    // Caching MRF, fetch the missing tiles in parallel first
+    if (eRWFlag == GF_Read && nBufXSize == nXSize && nBufYSize == nYSize && !source.empty())
+        PrefetchTiles(nXOff, nYOff, nXSize, nYSize, nBandCount, panBandMap);
+
     //
     // Call the parent implementation, which splits it into bands and calls their IRasterIO
     //
@@ -353,9 +423,38 @@ CPLErr GDALMRFDataset::IBuildOverviews(
             // Generate the overview using the previous level as the source
 
             // Use "avg" flag to trigger the internal average sampling
-            if (EQUALN("Avg", pszResampling, 3) || EQUALN("NearNb", pszResampling, 4)) {
+            // The filtering modes need whole pages, they are only internal for local MRFs
+            int sampling = SamplingMode(pszResampling);
+            if (!source.empty() && (sampling == SAMPLING_Linear || sampling == SAMPLING_Cubic))
+                sampling = SAMPLING_ERR;
+
+            // DCT builds up to three of the requested levels in one pass over the base pages
+            int n = DCTGroupSize(srclevel, sampling);
+            while (n > 1 && (i + n > nOverviews
+                || panOverviewListNew[i + n - 1] != panOverviewListNew[i] << (n - 1)))
+                n--;
+
+            if (n > 1) {
+                // Commit any pending writes, and drop the cached blocks which get stale
+                for (int band = 1; band <= nBands; band++) {
+                    GDALRasterBand *pb = GetRasterBand(band);
+                    (srclevel ? pb->GetOverview(srclevel - 1) : pb)->FlushCache();
+                    for (int l = srclevel; l < srclevel + n; l++)
+                        pb->GetOverview(l)->FlushCache();
+                }
 
-                int sampling = EQUALN("Avg", pszResampling, 3) ? SAMPLING_Avg : SAMPLING_Near;
+                b = static_cast<GDALMRFRasterBand *>(b->GetOverview(srclevel + n - 1));
+                eErr = PatchPagesDCT(0, 0, b->nBlocksPerRow, b->nBlocksPerColumn, srclevel, 1, n);
+                if (eErr == CE_Failure)
+                    throw eErr;
+
+                // All the levels of the group got regenerated
+                if (InitDirty())
+                    for (int l = srclevel; l < srclevel + n; l++)
+                        ClearDirty(l);
+                i += n - 1;
+            }
+            else if (sampling != SAMPLING_ERR) {
                 // Internal, using PatchOverview
                 if (srclevel > 0)
                     b = static_cast<GDALMRFRasterBand *>(b->GetOverview(srclevel - 1));
@@ -364,6 +463,10 @@ CPLErr GDALMRFDataset::IBuildOverviews(
                     0, sampling);
                 if (eErr == CE_Failure)
                     throw eErr;
+
+                // The whole level got regenerated from this one
+                if (InitDirty())
+                    ClearDirty(srclevel);
             }
             else
             {
@@ -610,6 +713,10 @@ GDALDataset *GDALMRFDataset::Open(GDALOpenInfo *poOpenInfo)
         return NULL;
     }
 
+    // Decide on dirty tracking once, before any write
+    if (ds->eAccess == GA_Update && level == -1)
+        ds->InitDirty();
+
     // Tell PAM what our real file name is, to help it find the aux.xml
     ds->SetPhysicalFilename(pszFileName);
     // Don't mess with metadata after this, otherwise PAM will re-write the aux.xml
@@ -629,14 +736,19 @@ CPLErr GDALMRFDataset::SetVersion(int version) {
         CPLError(CE_Failure, CPLE_AppDefined, "GDAL MRF: Version number error!");
         return CE_Failure;
     }
+    // Delta versions are resolved when reading the tile index
+    if (deltaVersions) {
+        hasVersions = 0;
+        return ReadDeltas(version);
+    }
     // Size of one version index
     for (int bcount = 1; bcount <= nBands; bcount++) {
         GDALMRFRasterBand *srcband = reinterpret_cast<GDALMRFRasterBand *>(GetRasterBand(bcount));
-        srcband->img.idxoffset += idxSize*verCount;
+        srcband->img.idxoffset += idxSize*version;
         for (int l = 0; l < srcband->GetOverviewCount(); l++) {
             GDALMRFRasterBand *band = reinterpret_cast<GDALMRFRasterBand *>(srcband->GetOverview(l));
             if( band != NULL )
-                band->img.idxoffset += idxSize*verCount;
+                band->img.idxoffset += idxSize*version;
         }
     }
     hasVersions = 0;
@@ -944,6 +1056,19 @@ VSILFILE *GDALMRFDataset::IdxFP() {
     if (ifp.FP != NULL)
         return ifp.FP;
 
+    // A cache index is opened together with the data file, since CompactCache replaces both
+    if (!source.empty() && !clonedSource) {
+        void *hLock = LockCache(false);
+        VSILFILE *fp = OpenIdxFP();
+        if (fp)
+            DataFP();
+        UnlockCache(hLock);
+        return fp;
+    }
+    return OpenIdxFP();
+}
+
+VSILFILE *GDALMRFDataset::OpenIdxFP() {
     // If name starts with '(' it is not a real file name
     if (current.idxfname[0] == '(')
         return NULL;
@@ -951,13 +1076,20 @@ VSILFILE *GDALMRFDataset::IdxFP() {
     const char *mode = "rb";
     ifp.acc = GF_Read;
 
-    if (eAccess == GA_Update || !source.empty()) {
+    if (eAccess == GA_Update || !source.empty() || SynthPersist()) {
         mode = "r+b";
         ifp.acc = GF_Write;
     }
 
     ifp.FP = VSIFOpenL(current.idxfname, mode);
 
+    // Storing the synthesized tiles is optional, read only is fine
+    if (ifp.FP == NULL && eAccess != GA_Update && source.empty() && ifp.acc == GF_Write) {
+        mode = "rb";
+        ifp.acc = GF_Read;
+        ifp.FP = VSIFOpenL(current.idxfname, mode);
+    }
+
     // need to create the index file
     if (ifp.FP == NULL && !bCrystalized && (eAccess == GA_Update || !source.empty())) {
         mode = "w+b";
@@ -1056,11 +1188,16 @@ VSILFILE *GDALMRFDataset::IdxFP() {
 VSILFILE *GDALMRFDataset::DataFP() {
     if (dfp.FP != NULL)
         return dfp.FP;
+
+    // Opened along with the cache index, see IdxFP
+    if (!source.empty() && !clonedSource && NULL == ifp.FP && NULL != IdxFP() && NULL != dfp.FP)
+        return dfp.FP;
+
     const char *mode = "rb";
     dfp.acc = GF_Read;
 
-    // Open it for writing if updating or if caching
-    if (eAccess == GA_Update || !source.empty()) {
+    // Open it for writing if updating, if caching or if storing synthesized tiles
+    if (eAccess == GA_Update || !source.empty() || SynthPersist()) {
         mode = "a+b";
         dfp.acc = GF_Write;
     }
@@ -1069,6 +1206,15 @@ VSILFILE *GDALMRFDataset::DataFP() {
     if (dfp.FP)
         return dfp.FP;
 
+    // Storing the synthesized tiles is optional, read only is fine
+    if (eAccess != GA_Update && source.empty() && dfp.acc == GF_Write) {
+        mode = "rb";
+        dfp.acc = GF_Read;
+        dfp.FP = VSIFOpenL(current.datfname, mode);
+        if (dfp.FP)
+            return dfp.FP;
+    }
+
     // It could be a caching MRF
     if (source.empty())
         goto io_error;
@@ -1231,7 +1377,9 @@ CPLErr GDALMRFDataset::Initialize(CPLXMLNode *config)
 
     CPLErr ret = Init_Raster(full, this, CPLGetXMLNode(config, "Raster"));
 
-    hasVersions = on(CPLGetXMLValue(config, "Raster.versioned", "no"));
+    const char *pszVersioned = CPLGetXMLValue(config, "Raster.versioned", "no");
+    deltaVersions = EQUAL(pszVersioned, "delta");
+    hasVersions = on(pszVersioned) || deltaVersions;
     mp_safe = on(CPLGetXMLValue(config, "Raster.mp_safe", "no"));
     spacing = atoi(CPLGetXMLValue(config, "Raster.Spacing", "0"));
 
@@ -1384,7 +1532,11 @@ CPLErr GDALMRFDataset::Initialize(CPLXMLNode *config)
         }
     }
 
-    if (hasVersions) { // It has versions, but how many?
+    if (deltaVersions) { // Versions are kept as records after the index
+        if (CE_None != ReadDeltas(0))
+            return CE_Failure;
+    }
+    else if (hasVersions) { // It has versions, but how many?
         verCount = 0; // Assume it only has one
         VSIStatBufL statb;
         //  If the file exists, compute the last version number
@@ -1419,18 +1571,40 @@ static inline void make_absolute(CPLString &name, const CPLString &path)
 */
 GDALDataset *GDALMRFDataset::GetSrcDS() {
     if (poSrcDS) return poSrcDS;
+    // Don't retry a source which failed to open recently
+    if (FetchFailed(SOURCE_FAILURE))
+        return NULL;
+    poSrcDS = OpenSrcDS();
+    if (!poSrcDS && !source.empty())
+        FetchFailure(SOURCE_FAILURE);
+    mp_safe = true; // Turn on MP safety
+    return poSrcDS;
+}
+
+/**
+*\brief Open the source dataset, the caller owns it if not shared
+*/
+GDALDataset *GDALMRFDataset::OpenSrcDS(bool shared) {
     if (source.empty()) return NULL;
     // Make the source absolute path
     if (has_path(fname)) make_absolute(source, fname);
-    poSrcDS = (GDALDataset *)GDALOpenShared(source.c_str(), GA_ReadOnly);
-    if (0 == source.find("<MRF_META>") && has_path(fname))
+    GDALDataset *poDS = (GDALDataset *)(shared ? GDALOpenShared(source.c_str(), GA_ReadOnly)
+        : GDALOpen(source.c_str(), GA_ReadOnly));
+    // Z delta tiles refer to their key tiles by data file offset, which a clone doesn't keep
+    if (poDS && clonedSource && EQUAL(poDS->GetDriver()->GetDescription(), "MRF")
+        && static_cast<GDALMRFDataset *>(poDS)->ZDeltaInterval() > 1)
+    {
+        CPLError(CE_Failure, CPLE_NotSupported, "MRF: Z delta coded MRFs can't be cloned");
+        GDALClose(poDS);
+        return NULL;
+    }
+    if (poDS && 0 == source.find("<MRF_META>") && has_path(fname))
     {// XML MRF source, might need to patch the file names with the current one
-        GDALMRFDataset *psDS = reinterpret_cast<GDALMRFDataset *>(poSrcDS);
+        GDALMRFDataset *psDS = reinterpret_cast<GDALMRFDataset *>(poDS);
         make_absolute(psDS->current.datfname, fname);
         make_absolute(psDS->current.idxfname, fname);
     }
-    mp_safe = true; // Turn on MP safety
-    return poSrcDS;
+    return poDS;
 }
 
 /**
@@ -1790,6 +1964,13 @@ void GDALMRFDataset::Crystalize()
 // Copy the first index at the end of the file and bump the version count
 CPLErr GDALMRFDataset::AddVersion()
 {
+    // A delta version starts empty, records are saved as the tiles change
+    if (deltaVersions) {
+        verCount++;
+        verLatest.clear();
+        return CE_None;
+    }
+
     VSILFILE *l_ifp = IdxFP();
 
     void *tbuff = CPLMalloc(static_cast<size_t>(idxSize));
@@ -1802,6 +1983,932 @@ CPLErr GDALMRFDataset::AddVersion()
     return CE_None;
 }
 
+//
+// Delta versions are stored as ILDelta records, appended after the current index.
+// A version only holds the index records of the tiles which changed after it was
+// superseded, so a record missing from a version is found in the next one, and
+// ultimately in the current index.  The records are in version order.
+// Reads all the records, sets the version count and the records already saved for the
+// last version. If version is not zero, keeps the records that define that version
+//
+CPLErr GDALMRFDataset::ReadDeltas(int version)
+{
+    verCount = 0;
+    verLatest.clear();
+    verMap.clear();
+
+    VSIStatBufL statb;
+    if (0 != VSIStatL(full.idxfname, &statb) || statb.st_size <= idxSize)
+        return CE_None; // No versions yet
+
+    VSILFILE *l_ifp = IdxFP();
+    if (l_ifp == NULL)
+        return CE_Failure;
+
+    const size_t CHUNK = 1024; // records
+    vector<ILDelta> buf(CHUNK);
+    CPLMutexHolderD(IOMutex());
+    VSIFSeekL(l_ifp, idxSize, SEEK_SET);
+    size_t count;
+    while (0 != (count = VSIFReadL(&buf[0], sizeof(ILDelta), CHUNK, l_ifp))) {
+        for (size_t i = 0; i < count; i++) {
+            int v = static_cast<int>(net64(buf[i].version));
+            GIntBig infooffset = net64(buf[i].infooffset);
+            if (v <= 0) // Unused space
+                continue;
+            if (v > verCount) { // Next version
+                verCount = v;
+                verLatest.clear();
+            }
+            verLatest.insert(infooffset);
+            // The first record found is the one for the version
+            if (version != 0 && v >= version)
+                verMap.insert(std::make_pair(infooffset, buf[i].idx));
+        }
+        if (count < CHUNK)
+            break;
+    }
+
+    if (version > verCount) {
+        CPLError(CE_Failure, CPLE_AppDefined, "GDAL MRF: Version number error!");
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+// Save the index record of a tile about to change in the last version, tinfo is in net order
+CPLErr GDALMRFDataset::SaveDelta(GUIntBig infooffset, const ILIdx &tinfo)
+{
+    VSILFILE *l_ifp = IdxFP();
+    if (l_ifp == NULL)
+        return CE_Failure;
+
+    ILDelta rec;
+    rec.version = net64(GIntBig(verCount));
+    rec.infooffset = net64(infooffset);
+    rec.idx = tinfo;
+
+    // Append, but never within the current index
+    VSIFSeekL(l_ifp, 0, SEEK_END);
+    GIntBig pos = std::max(GIntBig(VSIFTellL(l_ifp)), idxSize);
+    VSIFSeekL(l_ifp, pos, SEEK_SET);
+    if (1 != VSIFWriteL(&rec, sizeof(rec), 1, l_ifp)) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't save version record");
+        return CE_Failure;
+    }
+    verLatest.insert(infooffset);
+    return CE_None;
+}
+
+//
+// List the tiles which index records differ between two versions
+// For full index versions, the two index copies are compared in large blocks, record by
+// record only when a block differs.  For delta versions, only the records saved by the
+// versions between the two are compared
+//
+CPLErr GDALMRFDataset::ChangedTiles(int v1, int v2, vector<ILSize> &tiles, vector<ILIdx> *records)
+{
+    tiles.clear();
+    if (records)
+        records->clear();
+
+    if (!hasVersions) {
+        CPLError(CE_Failure, CPLE_AppDefined, "MRF: %s is not versioned, or not the current version",
+            fname.c_str());
+        return CE_Failure;
+    }
+
+    // Order them, the current version is the newest
+    if (v1 == 0) v1 = verCount + 1;
+    if (v2 == 0) v2 = verCount + 1;
+    if (v1 > v2) std::swap(v1, v2);
+    if (v1 < 1 || v2 > verCount + 1) {
+        CPLError(CE_Failure, CPLE_AppDefined, "GDAL MRF: Version number error!");
+        return CE_Failure;
+    }
+
+    VSILFILE *l_ifp = IdxFP();
+    if (l_ifp == NULL)
+        return CE_Failure;
+
+    // Infooffset of the changed records and the new record, in net order
+    vector<std::pair<GIntBig, ILIdx> > changed;
+    CPLMutexHolderD(IOMutex());
+
+    if (v1 == v2) {
+        // Nothing changed
+    }
+    else if (!deltaVersions) {
+        const size_t CHUNK = 64 * 1024; // records
+        vector<ILIdx> b1(CHUNK), b2(CHUNK);
+        GIntBig off1 = (v1 > verCount) ? 0 : idxSize * v1;
+        GIntBig off2 = (v2 > verCount) ? 0 : idxSize * v2;
+        for (GIntBig infooffset = 0; infooffset < idxSize; infooffset += CHUNK * sizeof(ILIdx)) {
+            size_t count = static_cast<size_t>(
+                std::min(GIntBig(CHUNK), (idxSize - infooffset) / GIntBig(sizeof(ILIdx))));
+            // Missing records are zero
+            memset(&b1[0], 0, count * sizeof(ILIdx));
+            memset(&b2[0], 0, count * sizeof(ILIdx));
+            VSIFSeekL(l_ifp, off1 + infooffset, SEEK_SET);
+            VSIFReadL(&b1[0], sizeof(ILIdx), count, l_ifp);
+            VSIFSeekL(l_ifp, off2 + infooffset, SEEK_SET);
+            VSIFReadL(&b2[0], sizeof(ILIdx), count, l_ifp);
+            if (0 == memcmp(&b1[0], &b2[0], count * sizeof(ILIdx)))
+                continue;
+            for (size_t i = 0; i < count; i++)
+                if (b1[i].offset != b2[i].offset || b1[i].size != b2[i].size)
+                    changed.push_back(std::make_pair(GIntBig(infooffset + i * sizeof(ILIdx)), b2[i]));
+        }
+    }
+    else {
+        // The records as they were in the two versions, and the tiles that changed in between
+        std::map<GIntBig, ILIdx> m1, m2;
+        std::set<GIntBig> candidates;
+        const size_t CHUNK = 1024; // records
+        vector<ILDelta> buf(CHUNK);
+        VSIFSeekL(l_ifp, idxSize, SEEK_SET);
+        size_t count;
+        while (0 != (count = VSIFReadL(&buf[0], sizeof(ILDelta), CHUNK, l_ifp))) {
+            for (size_t i = 0; i < count; i++) {
+                int v = static_cast<int>(net64(buf[i].version));
+                GIntBig infooffset = net64(buf[i].infooffset);
+                if (v < v1)
+                    continue;
+                m1.insert(std::make_pair(infooffset, buf[i].idx));
+                if (v >= v2)
+                    m2.insert(std::make_pair(infooffset, buf[i].idx));
+                else
+                    candidates.insert(infooffset);
+            }
+            if (count < CHUNK)
+                break;
+        }
+
+        for (std::set<GIntBig>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
+            ILIdx r1 = m1[*it];
+            ILIdx r2 = { 0, 0 };
+            std::map<GIntBig, ILIdx>::const_iterator found = m2.find(*it);
+            if (found != m2.end())
+                r2 = found->second;
+            else { // Current index
+                VSIFSeekL(l_ifp, *it, SEEK_SET);
+                VSIFReadL(&r2, sizeof(ILIdx), 1, l_ifp);
+            }
+            if (r1.offset != r2.offset || r1.size != r2.size)
+                changed.push_back(std::make_pair(*it, r2));
+        }
+    }
+
+    // Convert the index offsets to tile positions, using the first band of each level
+    GDALMRFRasterBand *b = static_cast<GDALMRFRasterBand *>(GetRasterBand(1));
+    size_t j = 0;
+    for (int l = 0; b != NULL && j < changed.size(); l++) {
+        const ILImage &img = b->img;
+        // The band index starts at the current Z slice
+        GIntBig start = img.idxoffset;
+        if (img.size.z > 1)
+            start -= sizeof(ILIdx) * img.pagecount.l / img.size.z * zslice;
+        GIntBig end = start + img.pagecount.l * sizeof(ILIdx);
+        for (; j < changed.size() && changed[j].first < end; j++) {
+            GIntBig rec = (changed[j].first - start) / sizeof(ILIdx);
+            if (rec < 0)
+                continue;
+            ILSize pos;
+            pos.c = static_cast<int>(rec % img.pagecount.c);
+            rec /= img.pagecount.c;
+            pos.x = static_cast<int>(rec % img.pagecount.x);
+            rec /= img.pagecount.x;
+            pos.y = static_cast<int>(rec % img.pagecount.y);
+            pos.z = static_cast<int>(rec / img.pagecount.y);
+            pos.l = l;
+            tiles.push_back(pos);
+            if (records) {
+                ILIdx r = { GIntBig(net64(changed[j].second.offset)), GIntBig(net64(changed[j].second.size)) };
+                records->push_back(r);
+            }
+        }
+        b = (l < GetRasterBand(1)->GetOverviewCount()) ?
+            static_cast<GDALMRFRasterBand *>(GetRasterBand(1)->GetOverview(l)) : NULL;
+    }
+
+    return CE_None;
+}
+
+// Location of a tile in the data file being pruned, and the new location
+struct PruneTile {
+    GIntBig size;
+    GIntBig offset;
+};
+
+// Record the data used by an index record in net order
+static void PruneUse(std::map<GIntBig, PruneTile> &used, const ILIdx &rec)
+{
+    GIntBig size = net64(rec.size);
+    if (size == 0)
+        return;
+    PruneTile &t = used[GIntBig(net64(rec.offset))];
+    t.size = std::max(t.size, size);
+}
+
+// Change the data offset of an index record in net order to the new one
+static void PruneMove(std::map<GIntBig, PruneTile> &used, ILIdx &rec)
+{
+    if (rec.size == 0)
+        return;
+    std::map<GIntBig, PruneTile>::const_iterator it = used.find(net64(rec.offset));
+    if (it != used.end())
+        rec.offset = net64(it->second.offset);
+}
+
+//
+// Drop the oldest versions and compact the data file
+// The new index and data files are written next to the existing ones, then replace them
+// The surviving versions are renumbered, starting from 1. Nothing else can use the MRF
+// while this runs
+//
+CPLErr GDALMRFDataset::PruneVersions(int keep, GDALProgressFunc pfnProgress, void *pProgressData,
+    GIntBig *pnBytes)
+{
+    if (pnBytes)
+        *pnBytes = 0;
+    if (!hasVersions || eAccess != GA_Update || keep < 0) {
+        CPLError(CE_Failure, CPLE_AppDefined,
+            "MRF: Pruning needs the current version of a versioned MRF, in update mode");
+        return CE_Failure;
+    }
+    // Z delta tiles refer to their key tiles by data file offset
+    if (ZDeltaInterval() > 1) {
+        CPLError(CE_Failure, CPLE_NotSupported, "MRF: Z delta coded MRFs can't be pruned");
+        return CE_Failure;
+    }
+    if (pfnProgress == NULL)
+        pfnProgress = GDALDummyProgress;
+
+    VSILFILE *l_ifp = IdxFP();
+    VSILFILE *l_dfp = DataFP();
+    if (l_ifp == NULL || l_dfp == NULL)
+        return CE_Failure;
+
+    CPLMutexHolderD(IOMutex());
+    const int drop = std::max(verCount - keep, 0);
+    const size_t CHUNK = 64 * 1024; // records
+
+    // The index copies that survive, where they are and where they go
+    vector<std::pair<GIntBig, GIntBig> > segments;
+    segments.push_back(std::make_pair(GIntBig(0), GIntBig(0)));
+    if (!deltaVersions)
+        for (int v = drop + 1; v <= verCount; v++)
+            segments.push_back(std::make_pair(idxSize * v, idxSize * (v - drop)));
+
+    // Find the tiles still in use
+    std::map<GIntBig, PruneTile> used;
+    vector<ILIdx> buf(CHUNK);
+    for (size_t s = 0; s < segments.size(); s++) {
+        for (GIntBig pos = 0; pos < idxSize; pos += CHUNK * sizeof(ILIdx)) {
+            size_t count = static_cast<size_t>(
+                std::min(GIntBig(CHUNK), (idxSize - pos) / GIntBig(sizeof(ILIdx))));
+            memset(&buf[0], 0, count * sizeof(ILIdx));
+            VSIFSeekL(l_ifp, segments[s].first + pos, SEEK_SET);
+            VSIFReadL(&buf[0], sizeof(ILIdx), count, l_ifp);
+            for (size_t i = 0; i < count; i++)
+                PruneUse(used, buf[i]);
+        }
+    }
+
+    vector<ILDelta> dbuf;
+    if (deltaVersions) {
+        dbuf.resize(CHUNK);
+        VSIFSeekL(l_ifp, idxSize, SEEK_SET);
+        size_t count;
+        while (0 != (count = VSIFReadL(&dbuf[0], sizeof(ILDelta), CHUNK, l_ifp))) {
+            for (size_t i = 0; i < count; i++)
+                if (GIntBig(net64(dbuf[i].version)) > drop)
+                    PruneUse(used, dbuf[i].idx);
+            if (count < CHUNK)
+                break;
+        }
+    }
+
+    // Copy the tiles in use, in data file order, with their spacing
+    CPLString datfname = current.datfname + ".prune";
+    CPLString idxfname = current.idxfname + ".prune";
+    VSILFILE *ndfp = VSIFOpenL(datfname, "wb");
+    VSILFILE *nifp = ndfp ? VSIFOpenL(idxfname, "wb") : NULL;
+    if (nifp == NULL) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't create %s", ndfp ? idxfname.c_str() : datfname.c_str());
+        if (ndfp)
+            VSIFCloseL(ndfp);
+        return CE_Failure;
+    }
+
+    CPLErr ret = CE_None;
+    GIntBig total = 0;
+    for (std::map<GIntBig, PruneTile>::const_iterator it = used.begin(); it != used.end(); ++it)
+        total += it->second.size + spacing;
+    vector<char> tbuf;
+    GIntBig newpos = 0, done = 0;
+    for (std::map<GIntBig, PruneTile>::iterator it = used.begin();
+        ret == CE_None && it != used.end(); ++it)
+    {
+        GIntBig start = std::max(it->first - spacing, GIntBig(0));
+        size_t size = static_cast<size_t>(it->first + it->second.size - start);
+        if (tbuf.size() < size)
+            tbuf.resize(size);
+        VSIFSeekL(l_dfp, start, SEEK_SET);
+        if (size != VSIFReadL(&tbuf[0], 1, size, l_dfp) || size != VSIFWriteL(&tbuf[0], 1, size, ndfp)) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Error copying data to %s", datfname.c_str());
+            ret = CE_Failure;
+        }
+        it->second.offset = newpos + (it->first - start);
+        newpos += size;
+        done += size;
+        if (!pfnProgress(0.9 * done / std::max(total, GIntBig(1)), NULL, pProgressData)) {
+            CPLError(CE_Failure, CPLE_UserInterrupt, "User abort");
+            ret = CE_Failure;
+        }
+    }
+
+    // Write the new index, with the new tile locations
+    for (size_t s = 0; ret == CE_None && s < segments.size(); s++) {
+        for (GIntBig pos = 0; ret == CE_None && pos < idxSize; pos += CHUNK * sizeof(ILIdx)) {
+            size_t count = static_cast<size_t>(
+                std::min(GIntBig(CHUNK), (idxSize - pos) / GIntBig(sizeof(ILIdx))));
+            memset(&buf[0], 0, count * sizeof(ILIdx));
+            VSIFSeekL(l_ifp, segments[s].first + pos, SEEK_SET);
+            VSIFReadL(&buf[0], sizeof(ILIdx), count, l_ifp);
+            for (size_t i = 0; i < count; i++)
+                PruneMove(used, buf[i]);
+            VSIFSeekL(nifp, segments[s].second + pos, SEEK_SET);
+            if (count != VSIFWriteL(&buf[0], sizeof(ILIdx), count, nifp))
+                ret = CE_Failure;
+        }
+    }
+
+    if (ret == CE_None && deltaVersions) {
+        VSIFSeekL(l_ifp, idxSize, SEEK_SET);
+        VSIFSeekL(nifp, idxSize, SEEK_SET);
+        size_t count;
+        while (ret == CE_None && 0 != (count = VSIFReadL(&dbuf[0], sizeof(ILDelta), CHUNK, l_ifp))) {
+            size_t kept = 0;
+            for (size_t i = 0; i < count; i++) {
+                GIntBig v = net64(dbuf[i].version);
+                if (v <= drop)
+                    continue;
+                dbuf[kept] = dbuf[i];
+                dbuf[kept].version = net64(v - drop);
+                PruneMove(used, dbuf[kept].idx);
+                kept++;
+            }
+            if (kept != VSIFWriteL(&dbuf[0], sizeof(ILDelta), kept, nifp))
+                ret = CE_Failure;
+            if (count < CHUNK)
+                break;
+        }
+    }
+
+    if (ret == CE_None && !pfnProgress(1.0, NULL, pProgressData))
+        ret = CE_Failure;
+
+    VSIFCloseL(ndfp);
+    VSIFCloseL(nifp);
+    if (ret != CE_None) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Pruning failed, the MRF is unchanged");
+        VSIUnlink(datfname);
+        VSIUnlink(idxfname);
+        return CE_Failure;
+    }
+
+    // Replace the files, they get opened again when needed
+    VSIFSeekL(l_dfp, 0, SEEK_END);
+    GIntBig reclaimed = VSIFTellL(l_dfp) - newpos;
+    VSIFCloseL(ifp.FP);
+    ifp.FP = NULL;
+    VSIFCloseL(dfp.FP);
+    dfp.FP = NULL;
+
+    // Keep the original files until both new ones are in place, restore them on failure
+    CPLString idxold = current.idxfname + ".old";
+    CPLString datold = current.datfname + ".old";
+    int step = 0;
+    if (0 == VSIRename(current.idxfname, idxold)) step++;
+    if (step == 1 && 0 == VSIRename(current.datfname, datold)) step++;
+    if (step == 2 && 0 == VSIRename(datfname, current.datfname)) step++;
+    if (step == 3 && 0 == VSIRename(idxfname, current.idxfname)) step++;
+
+    if (step != 4) {
+        if (step == 3)
+            VSIRename(current.datfname, datfname);
+        if (step >= 2)
+            VSIRename(datold, current.datfname);
+        if (step >= 1)
+            VSIRename(idxold, current.idxfname);
+        VSIUnlink(datfname);
+        VSIUnlink(idxfname);
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't replace %s and %s, the MRF is unchanged",
+            current.datfname.c_str(), current.idxfname.c_str());
+        return CE_Failure;
+    }
+    VSIUnlink(datold);
+    VSIUnlink(idxold);
+
+    if (pnBytes)
+        *pnBytes = reclaimed;
+    if (deltaVersions)
+        return ReadDeltas(0);
+    verCount -= drop;
+    return CE_None;
+}
+
+// Limit for the ZSTACK_THREADS
+#define MAX_ZSTACK_THREADS 64
+
+// A tile of a Z stack read, the slice index within the read and the tile record
+struct ZStackTile {
+    int z, x, y;
+    ILIdx tinfo;
+};
+
+// The Z stack read, shared by the decoding threads
+struct ZStackList {
+    GDALMRFRasterBand *band;
+    int nXOff, nYOff, nXSize, nYSize, nZOff;
+    GByte *pData;
+    GDALDataType eBufType;
+    vector<ZStackTile> tiles;
+    size_t next;
+    CPLErr ret;
+    CPLMutex *hMutex;
+};
+
+// Decode the tiles and copy the part within the window to the output buffer
+void GDALMRFDataset::ZStackThread(void *p)
+{
+    ZStackList *list = static_cast<ZStackList *>(p);
+    GDALMRFRasterBand *band = list->band;
+    const ILImage &img = band->img;
+    const int cstride = img.pagesize.c;
+    const int dsz = GDALGetDataTypeSize(img.dt) / 8;
+    const int bsz = GDALGetDataTypeSize(list->eBufType) / 8;
+    int success;
+    double ndv = band->GetNoDataValue(&success);
+    if (!success) ndv = 0.0;
+
+    void *page = VSIMalloc(static_cast<size_t>(img.pageSizeBytes));
+    if (!page) {
+        CPLMutexHolderD(&list->hMutex);
+        list->ret = CE_Failure;
+        return;
+    }
+
+    for (;;) {
+        size_t i;
+        {
+            CPLMutexHolderD(&list->hMutex);
+            i = list->next++;
+            if (list->ret != CE_None)
+                break;
+        }
+        if (i >= list->tiles.size())
+            break;
+
+        const ZStackTile &t = list->tiles[i];
+        bool empty = (0 == t.tinfo.size);
+        if (!empty && CE_None != band->ReadPage(t.tinfo, page, 1, list->nZOff + t.z)) {
+            CPLMutexHolderD(&list->hMutex);
+            list->ret = CE_Failure;
+            break;
+        }
+
+        // The window part of this tile
+        int x0 = std::max(list->nXOff, t.x * img.pagesize.x);
+        int x1 = std::min(list->nXOff + list->nXSize, (t.x + 1) * img.pagesize.x);
+        int y0 = std::max(list->nYOff, t.y * img.pagesize.y);
+        int y1 = std::min(list->nYOff + list->nYSize, (t.y + 1) * img.pagesize.y);
+        for (int y = y0; y < y1; y++) {
+            GByte *dst = list->pData + bsz * ((GIntBig(t.z) * list->nYSize + y - list->nYOff)
+                * list->nXSize + x0 - list->nXOff);
+            if (empty) {
+                GDALCopyWords(&ndv, GDT_Float64, 0, dst, list->eBufType, bsz, x1 - x0);
+                continue;
+            }
+            GByte *src = static_cast<GByte *>(page) + dsz * ((GIntBig(y - t.y * img.pagesize.y)
+                * img.pagesize.x + x0 - t.x * img.pagesize.x) * cstride + (band->GetBand() - 1) % cstride);
+            GDALCopyWords(src, img.dt, dsz * cstride, dst, list->eBufType, bsz, x1 - x0);
+        }
+    }
+
+    CPLFree(page);
+}
+
+//
+// Read a window from a range of Z slices. The index records of a row of tiles are read
+// with a single read for each slice, then the tiles are decoded, in parallel if the
+// ZSTACK_THREADS option is set
+//
+CPLErr GDALMRFDataset::ReadZStack(int nBand, int nXOff, int nYOff, int nXSize, int nYSize,
+    int nZOff, int nZCount, void *pData, GDALDataType eBufType)
+{
+    GDALMRFRasterBand *band = static_cast<GDALMRFRasterBand *>(GetRasterBand(nBand));
+    if (!band || !source.empty() || level != -1 || !verMap.empty()) {
+        CPLError(CE_Failure, CPLE_AppDefined,
+            "MRF: Z stack reads need a band of the full resolution of a local MRF");
+        return CE_Failure;
+    }
+
+    const ILImage &img = band->img;
+    if (nXOff < 0 || nYOff < 0 || nXSize <= 0 || nYSize <= 0
+        || nXOff + nXSize > img.size.x || nYOff + nYSize > img.size.y
+        || nZOff < 0 || nZCount <= 0 || nZOff + nZCount > img.size.z)
+    {
+        CPLError(CE_Failure, CPLE_IllegalArg, "MRF: Z stack read is outside of the raster");
+        return CE_Failure;
+    }
+
+    // Flush the pending writes, the tiles are read from the file
+    FlushCache();
+
+    VSILFILE *l_ifp = IdxFP();
+    if (l_ifp == NULL)
+        return CE_Failure;
+
+    ZStackList list;
+    list.band = band;
+    list.nXOff = nXOff;
+    list.nYOff = nYOff;
+    list.nXSize = nXSize;
+    list.nYSize = nYSize;
+    list.nZOff = nZOff;
+    list.pData = static_cast<GByte *>(pData);
+    list.eBufType = eBufType;
+    list.next = 0;
+    list.ret = CE_None;
+    list.hMutex = NULL;
+
+    const int tx0 = nXOff / img.pagesize.x;
+    const int tx1 = (nXOff + nXSize - 1) / img.pagesize.x;
+    const int ty0 = nYOff / img.pagesize.y;
+    const int ty1 = (nYOff + nYSize - 1) / img.pagesize.y;
+    const int c = (nBand - 1) / img.pagesize.c;
+
+    // The band index records start at the current slice, the slices follow each other
+    GIntBig sliceSize = sizeof(ILIdx) * img.pagecount.l / img.size.z;
+    ILImage zimg = img;
+    zimg.idxoffset -= sliceSize * zslice;
+
+    // A row of tiles, including all the interleaved band groups
+    const size_t count = static_cast<size_t>(tx1 - tx0 + 1) * img.pagecount.c;
+    vector<ILIdx> row(count);
+    {
+        CPLMutexHolderD(IOMutex());
+        for (int z = 0; z < nZCount; z++) {
+            for (int y = ty0; y <= ty1; y++) {
+                VSIFSeekL(l_ifp, IdxOffset(ILSize(tx0, y, nZOff + z, 0), zimg), SEEK_SET);
+                if (count != VSIFReadL(&row[0], sizeof(ILIdx), count, l_ifp)) {
+                    CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read the index of slice %d",
+                        nZOff + z);
+                    return CE_Failure;
+                }
+                for (int x = tx0; x <= tx1; x++) {
+                    ZStackTile t;
+                    t.z = z;
+                    t.x = x;
+                    t.y = y;
+                    t.tinfo.offset = net64(row[(x - tx0) * img.pagecount.c + c].offset);
+                    t.tinfo.size = net64(row[(x - tx0) * img.pagecount.c + c].size);
+                    list.tiles.push_back(t);
+                }
+            }
+        }
+    }
+
+    int nThreads = std::min(atoi(GetOptionValue("ZSTACK_THREADS", "1")), MAX_ZSTACK_THREADS);
+    nThreads = std::min(nThreads, static_cast<int>(list.tiles.size()));
+    if (nThreads < 2) {
+        ZStackThread(&list);
+    }
+    else {
+        vector<CPLJoinableThread *> threads;
+        for (int i = 0; i < nThreads; i++) {
+            CPLJoinableThread *t = CPLCreateJoinableThread(ZStackThread, &list);
+            if (t)
+                threads.push_back(t);
+        }
+        // Can't start threads, do it here
+        if (threads.empty())
+            ZStackThread(&list);
+        for (size_t i = 0; i < threads.size(); i++)
+            CPLJoinThread(threads[i]);
+    }
+
+    if (list.hMutex)
+        CPLDestroyMutex(list.hMutex);
+    return list.ret;
+}
+
+// Look for a string from the dataset options or from the environment
+const char *GDALMRFDataset::GetOptionValue(const char *opt, const char *def) const
+{
+    const char *optValue = optlist.FetchNameValue(opt);
+    if (optValue) return optValue;
+    return CPLGetConfigOption(opt, def);
+}
+
+//
+// Fetches in progress, for all the caching and cloned MRFs in the process
+// The key is the index file name and the index record offset, so datasets opened
+// on the same MRF share it
+//
+static CPLMutex *hFetchMutex = NULL;
+static CPLCond *hFetchCond = NULL;
+static std::set<CPLString> fetching;
+
+static CPLString FetchKey(const CPLString &idxfname, GUIntBig infooffset)
+{
+    return CPLOPrintf("%s:" CPL_FRMT_GUIB, idxfname.c_str(), infooffset);
+}
+
+bool GDALMRFDataset::ClaimFetch(GUIntBig infooffset, bool wait)
+{
+    CPLString key = FetchKey(current.idxfname, infooffset);
+    CPLMutexHolderD(&hFetchMutex);
+    if (!hFetchCond)
+        hFetchCond = CPLCreateCond();
+    if (!hFetchCond) // No threads, nothing to wait for
+        return true;
+
+    if (fetching.insert(key).second)
+        return true;
+
+    if (wait)
+        while (fetching.count(key))
+            CPLCondWait(hFetchCond, hFetchMutex);
+    return false;
+}
+
+void GDALMRFDataset::ReleaseFetch(GUIntBig infooffset)
+{
+    CPLString key = FetchKey(current.idxfname, infooffset);
+    CPLMutexHolderD(&hFetchMutex);
+    fetching.erase(key);
+    if (hFetchCond)
+        CPLCondBroadcast(hFetchCond);
+}
+
+#if !defined(_WIN32)
+// Lock handle, the open lock file holds the fcntl lock
+struct FetchLock {
+    int fd;
+    CPLString name;
+};
+#endif
+
+//
+// Processes sharing a caching MRF coordinate the fetches through lock files, one for each
+// tile being fetched, named after the index file and the index record offset
+// A process waits up to FETCH_LOCK_WAIT seconds for a lock held by another one
+//
+// On Windows the lock file is created exclusively and gets removed when closed, even
+// if the process fails.  Otherwise the lock is an fcntl write lock on the lock file,
+// which is released when the owner exits.  Within a process ClaimFetch ensures that
+// a single thread locks a given tile, as required by the fcntl locks
+//
+bool GDALMRFDataset::LockFetch(GUIntBig infooffset, void **phLock, bool wait)
+{
+    *phLock = NULL;
+    double dfWait = CPLAtof(GetOptionValue("FETCH_LOCK_WAIT", "0"));
+    if (dfWait <= 0)
+        return true;
+
+    CPLString lname = CPLOPrintf("%s." CPL_FRMT_GUIB, current.idxfname.c_str(), infooffset);
+
+#if defined(_WIN32)
+    *phLock = CPLLockFile(lname, wait ? dfWait : 0);
+    return *phLock != NULL;
+#else
+    CPLString lockfile = lname + ".lock";
+    for (double waited = 0;;) {
+        int fd = open(lockfile, O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't create lock file %s", lockfile.c_str());
+            return false;
+        }
+
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        if (0 == fcntl(fd, F_SETLK, &fl)) {
+            // The previous owner removes the file on release, make sure it is still the same one
+            struct stat sOpen, sName;
+            if (0 == fstat(fd, &sOpen) && 0 == stat(lockfile, &sName)
+                && sOpen.st_dev == sName.st_dev && sOpen.st_ino == sName.st_ino) {
+                FetchLock *psLock = new FetchLock;
+                psLock->fd = fd;
+                psLock->name = lockfile;
+                *phLock = psLock;
+                return true;
+            }
+            close(fd);
+            continue;
+        }
+
+        close(fd);
+        if (!wait || waited >= dfWait)
+            return false;
+        CPLSleep(0.05);
+        waited += 0.05;
+    }
+#endif
+}
+
+void GDALMRFDataset::UnlockFetch(void *hLock)
+{
+    if (!hLock)
+        return;
+#if defined(_WIN32)
+    CPLUnlockFile(hLock);
+#else
+    FetchLock *psLock = static_cast<FetchLock *>(hLock);
+    // Remove it while still holding the lock, waiting processes then retry with a new file
+    unlink(psLock->name);
+    close(psLock->fd);
+    delete psLock;
+#endif
+}
+
+//
+// Z delta coding key slice interval, from the ZDELTA option stored in the MRF, 0 if off
+//
+int GDALMRFDataset::ZDeltaInterval() const
+{
+    const char *val = optlist.FetchNameValue("ZDELTA");
+    return val ? atoi(val) : 0;
+}
+
+//
+// The key slice the tiles of slice z are relative to, -1 if it is a key slice, or if
+// Z delta coding does not apply.  Only for local MRFs with lossless compressions
+// All the stored tiles of the slices with a key slice end with the key tile record
+// z is the current slice if negative
+//
+int GDALMRFDataset::ZDeltaKey(int z) const
+{
+    if (z < 0)
+        z = zslice;
+    int interval = ZDeltaInterval();
+    if (interval < 2 || full.size.z < 2 || !source.empty() || 0 == z % interval)
+        return -1;
+    switch (full.comp) {
+    case IL_NONE: case IL_ZLIB: case IL_PNG: case IL_TIF:
+        return z - z % interval;
+    default:
+        return -1;
+    }
+}
+
+//
+// Synthesis of missing overview tiles, enabled by the SYNTHESIZE option, which is the
+// sampling method name.  Only for local MRFs open in read only mode, the filters which
+// need a halo are replaced by averaging
+//
+int GDALMRFDataset::SynthMode() const
+{
+    const char *pszSynth = GetOptionValue("SYNTHESIZE", NULL);
+    if (!pszSynth || eAccess != GA_ReadOnly || !source.empty() || EQUAL(pszSynth, "FALSE")
+        || EQUAL(pszSynth, "OFF") || EQUAL(pszSynth, "NO"))
+        return SAMPLING_ERR;
+    int sampling = SamplingMode(pszSynth);
+    if (sampling != SAMPLING_Near && sampling != SAMPLING_Mode)
+        sampling = SAMPLING_Avg;
+    return sampling;
+}
+
+int GDALMRFDataset::SynthPersist() const
+{
+    return SynthMode() != SAMPLING_ERR
+        && BOOLTEST(GetOptionValue("SYNTHESIZE_PERSIST", "FALSE"));
+}
+
+int GDALMRFDataset::CacheOverviewMode() const
+{
+    // Off unless requested, a true value selects averaging
+    const char *pszMode = GetOptionValue("CACHE_OVERVIEWS", "FALSE");
+    if (source.empty() || clonedSource || scale != 2.0 || EQUAL(pszMode, "FALSE")
+        || EQUAL(pszMode, "OFF") || EQUAL(pszMode, "NO"))
+        return SAMPLING_ERR;
+    int sampling = SamplingMode(pszMode);
+    if (sampling != SAMPLING_Near && sampling != SAMPLING_Mode)
+        sampling = SAMPLING_Avg;
+    return sampling;
+}
+
+//
+// Dirty tile tracking, enabled by the DIRTY_TRACKING option, for local MRFs open in update mode
+// The bitmaps for each level of the current slice are loaded from the sidecar file, which is
+// updated as soon as a new tile is marked, so the information survives a crash
+// The sidecar holds, for each Z slice, the bitmaps of all the levels in sequence
+//
+bool GDALMRFDataset::InitDirty()
+{
+    if (trackDirty != -1)
+        return trackDirty != 0;
+
+    trackDirty = eAccess == GA_Update && source.empty()
+        && BOOLTEST(GetOptionValue("DIRTY_TRACKING", "FALSE"));
+    if (!trackDirty)
+        return false;
+
+    // The parent tiles are found by halving the tile coordinates, nothing to refresh otherwise
+    if (scale != 2.0) {
+        if (scale != 0.0)
+            CPLError(CE_Warning, CPLE_NotSupported,
+                "MRF: Dirty tracking requires overviews with a scale of 2");
+        trackDirty = FALSE;
+        return false;
+    }
+
+    // Size of each level bitmap, in bytes
+    GDALRasterBand *b0 = GetRasterBand(1);
+    GIntBig zsize = 0;
+    for (int l = 0; l <= b0->GetOverviewCount(); l++) {
+        GDALMRFRasterBand *b = static_cast<GDALMRFRasterBand *>(l ? b0->GetOverview(l - 1) : b0);
+        GIntBig bits = static_cast<GIntBig>(b->img.pagecount.x) * b->img.pagecount.y;
+        dirty.push_back(std::vector<GByte>(static_cast<size_t>((bits + 7) / 8), 0));
+        dirtyOffset.push_back(zsize);
+        zsize += dirty.back().size();
+    }
+
+    // Slice offset in the sidecar
+    for (size_t l = 0; l < dirtyOffset.size(); l++)
+        dirtyOffset[l] += zslice * zsize;
+
+    CPLString dname = current.idxfname + ".dirty";
+    dirtyFP = VSIFOpenL(dname, "r+b");
+    if (!dirtyFP)
+        dirtyFP = VSIFOpenL(dname, "w+b");
+    if (!dirtyFP) {
+        CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't open dirty tile file %s", dname.c_str());
+        return true; // Keep tracking in memory
+    }
+
+    // A short or missing file means clean tiles
+    for (size_t l = 0; l < dirty.size(); l++) {
+        VSIFSeekL(dirtyFP, dirtyOffset[l], SEEK_SET);
+        VSIFReadL(&dirty[l][0], 1, dirty[l].size(), dirtyFP);
+    }
+
+    return true;
+}
+
+// Index of the tile bit in a level bitmap
+GIntBig GDALMRFDataset::DirtyBit(int x, int y, int l)
+{
+    GDALRasterBand *b = GetRasterBand(1);
+    if (l)
+        b = b->GetOverview(l - 1);
+    return static_cast<GIntBig>(y) * static_cast<GDALMRFRasterBand *>(b)->img.pagecount.x + x;
+}
+
+void GDALMRFDataset::MarkDirty(int x, int y, int l)
+{
+    if (!InitDirty() || l >= static_cast<int>(dirty.size()))
+        return;
+
+    GIntBig bit = DirtyBit(x, y, l);
+    GByte &byte = dirty[l][static_cast<size_t>(bit >> 3)];
+    GByte mask = static_cast<GByte>(1 << (bit & 7));
+    if (byte & mask)
+        return;
+
+    byte |= mask;
+    if (dirtyFP) {
+        VSIFSeekL(dirtyFP, dirtyOffset[l] + (bit >> 3), SEEK_SET);
+        VSIFWriteL(&byte, 1, 1, dirtyFP);
+        // Only once per tile, so it survives a crash at little cost
+        VSIFFlushL(dirtyFP);
+    }
+}
+
+bool GDALMRFDataset::IsDirty(int x, int y, int l)
+{
+    if (l >= static_cast<int>(dirty.size()))
+        return false;
+    GIntBig bit = DirtyBit(x, y, l);
+    return 0 != (dirty[l][static_cast<size_t>(bit >> 3)] & (1 << (bit & 7)));
+}
+
+// Mark all the tiles of a level clean
+void GDALMRFDataset::ClearDirty(int l)
+{
+    if (l >= static_cast<int>(dirty.size()))
+        return;
+    std::fill(dirty[l].begin(), dirty[l].end(), 0);
+    if (dirtyFP && !dirty[l].empty()) {
+        VSIFSeekL(dirtyFP, dirtyOffset[l], SEEK_SET);
+        VSIFWriteL(&dirty[l][0], 1, dirty[l].size(), dirtyFP);
+    }
+}
+
 //
 // Write a tile at the end of the data file
 // If buff and size are zero, it is equivalent to erasing the tile
@@ -1813,6 +2920,7 @@ CPLErr GDALMRFDataset::AddVersion()
 //
 CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
 {
+    CPLMutexHolderD(IOMutex());
     CPLErr ret = CE_None;
     ILIdx tinfo = { 0, 0 };
 
@@ -1834,7 +2942,11 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
         VSIFSeekL(l_ifp, infooffset, SEEK_SET);
         VSIFReadL(&tinfo, 1, sizeof(ILIdx), l_ifp);
 
-        if (verCount != 0) { // We need at least two versions before we test buffers
+        if (verCount != 0 && deltaVersions) {
+            // Already saved in the last version means it changed since then
+            new_version = (0 != verLatest.count(infooffset));
+        }
+        else if (verCount != 0) { // We need at least two versions before we test buffers
             ILIdx prevtinfo = { 0, 0 };
 
             // Read the previous one
@@ -1878,6 +2990,11 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
         // Do we need to start a new version before writing the tile?
         if (new_version)
             AddVersion();
+
+        // Keep the record of the tile for the last version, before it changes
+        if (deltaVersions && verCount != 0 && 0 == verLatest.count(infooffset)
+            && CE_None != SaveDelta(infooffset, tinfo))
+            return CE_Failure;
     }
 
     // Convert to net format
@@ -1987,9 +3104,25 @@ CPLErr GDALMRFDataset::GetGeoTransform(double *gt)
 CPLErr GDALMRFDataset::ReadTileIdx(ILIdx &tinfo, const ILSize &pos, const ILImage &img, const GIntBig bias)
 
 {
+    CPLMutexHolderD(IOMutex());
+    // First read of a cloned index, might start copying all of it
+    if (bias && !cloneStarted)
+        StartCloneIndex();
+
     VSILFILE *l_ifp = IdxFP();
 
     GIntBig offset = bias + IdxOffset(pos, img);
+
+    // Reading a previous delta version, the changed records are in memory
+    if (!verMap.empty()) {
+        std::map<GIntBig, ILIdx>::const_iterator it = verMap.find(offset);
+        if (it != verMap.end()) {
+            tinfo.offset = net64(it->second.offset);
+            tinfo.size = net64(it->second.size);
+            return CE_None;
+        }
+    }
+
     if (l_ifp == NULL && img.comp == IL_NONE ) {
         tinfo.size = current.pageSizeBytes;
         tinfo.offset = offset * tinfo.size;
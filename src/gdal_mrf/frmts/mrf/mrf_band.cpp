@@ -44,10 +44,12 @@
 
 #include "marfa.h"
 #include <gdal_priv.h>
+#include <cpl_multiproc.h>
 #include <ogr_srs_api.h>
 #include <ogr_spatialref.h>
 
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include "../zlib/zlib.h"
 
@@ -192,6 +194,58 @@ static void *DeflateBlock(buf_mgr &src, size_t extrasize, int flags) {
     return src.buffer;
 }
 
+// Z delta tile trailer, the key tile record followed by the signature
+static const char ZDELTA_SIG[] = "MRFZDLT1";
+#define ZDELTA_TRAILER (sizeof(ILIdx) + 8)
+
+// Integer values are replaced by the difference from the key values, modulo their size
+template<typename T> static void zdelta_int(T *page, const T *key, size_t count, bool encode)
+{
+    for (; count; page++, key++, count--)
+        *page = encode ? T(*page - *key) : T(*page + *key);
+}
+
+// Floating point values are XORed with the key values, which is exact
+template<typename T> static void zdelta_xor(T *page, const T *key, size_t count)
+{
+    for (; count; page++, key++, count--)
+        *page ^= *key;
+}
+
+// Complex values are filtered as pairs of their component values
+static void ZDeltaFilter(GDALDataType dt, void *page, const void *key, size_t bytes, bool encode)
+{
+    int vsz = GDALGetDataTypeSize(dt) / 8;
+    if (GDALDataTypeIsComplex(dt))
+        vsz /= 2;
+
+    switch (dt) {
+    case GDT_Float32: case GDT_Float64: case GDT_CFloat32: case GDT_CFloat64:
+        if (vsz == 4)
+            zdelta_xor(reinterpret_cast<GUInt32 *>(page), reinterpret_cast<const GUInt32 *>(key), bytes / 4);
+        else
+            zdelta_xor(reinterpret_cast<GUIntBig *>(page), reinterpret_cast<const GUIntBig *>(key), bytes / 8);
+        return;
+    default:
+        break;
+    }
+
+    switch (vsz) {
+    case 1:
+        zdelta_int(reinterpret_cast<GByte *>(page), reinterpret_cast<const GByte *>(key), bytes, encode);
+        break;
+    case 2:
+        zdelta_int(reinterpret_cast<GUInt16 *>(page), reinterpret_cast<const GUInt16 *>(key), bytes / 2, encode);
+        break;
+    case 4:
+        zdelta_int(reinterpret_cast<GUInt32 *>(page), reinterpret_cast<const GUInt32 *>(key), bytes / 4, encode);
+        break;
+    default:
+        CPLAssert(false);
+        break;
+    }
+}
+
 //
 // The deflate_flags are available in all bands even if the DEFLATE option
 // itself is not set.  This allows for PNG features to be controlled, as well
@@ -205,7 +259,8 @@ GDALMRFRasterBand::GDALMRFRasterBand( GDALMRFDataset *parent_dataset,
     deflate_flags(image.quality / 10),
     m_l(ov),
     img(image),
-    overview(0)
+    overview(0),
+    hEncodeMutex(NULL)
 {
     nBand = band;
     eDataType = parent_dataset->current.dt;
@@ -247,14 +302,14 @@ GDALMRFRasterBand::~GDALMRFRasterBand()
         delete overviews[overviews.size()-1];
         overviews.pop_back();
     };
+    if (hEncodeMutex)
+        CPLDestroyMutex(hEncodeMutex);
 }
 
 // Look for a string from the dataset options or from the environment
 const char * GDALMRFRasterBand::GetOptionValue(const char *opt, const char *def) const
 {
-    const char *optValue = poDS->optlist.FetchNameValue(opt);
-    if (optValue) return optValue;
-    return CPLGetConfigOption(opt, def);
+    return poDS->GetOptionValue(opt, def);
 }
 
 // Utility function, returns a value from a vector corresponding to the band index
@@ -405,31 +460,19 @@ CPLErr GDALMRFRasterBand::RB(int xblk, int yblk, buf_mgr /*src*/, void *buffer)
 }
 
 /**
-*\brief Fetch a block from the backing store dataset and keep a copy in the cache
+*\brief Read a region of nx by ny tiles of this level from the source
 *
-* @param xblk The X block number, zero based
-* @param yblk The Y block number, zero based
-* @param buffer buffer
+*  The buffer holds the region as a single page, pixel interleaved if the pages are.
+*  For band separate pages, allBands reads the regions of all the bands, one after the other.
+*  Parts outside of the source are filled with NoData
 *
 */
-CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
+CPLErr GDALMRFRasterBand::ReadSource(GDALDataset *poSrcDS, int tx0, int ty0, int nx, int ny,
+                                     void *buffer, bool allBands)
 {
-    assert(!poDS->source.empty());
-    CPLDebug("MRF_IB", "FetchBlock %d,%d,0,%d, level  %d\n", xblk, yblk, nBand, m_l);
-
-    if (poDS->clonedSource)  // This is a clone
-        return FetchClonedBlock(xblk, yblk, buffer);
-
     const GInt32 cstride = img.pagesize.c; // 1 if band separate
-    ILSize req(xblk, yblk, 0, (nBand-1) / cstride, m_l);
-    GUIntBig infooffset = IdxOffset(req, img);
-
-    GDALDataset *poSrcDS = NULL;
-    if ( NULL == (poSrcDS = poDS->GetSrcDS())) {
-        CPLError( CE_Failure, CPLE_AppDefined,
-                  "MRF: Can't open source file %s", poDS->source.c_str());
-        return CE_Failure;
-    }
+    // Band separate pages can be read for all the bands at once, one region after the other
+    const int nb = (1 == cstride && allBands) ? poDS->nBands : 1;
 
     // Scale to base resolution
     double scl = pow(poDS->scale, m_l);
@@ -438,10 +481,12 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
 
     // Prepare parameters for RasterIO, they might be different from a full page
     int vsz = GDALGetDataTypeSize(eDataType)/8;
-    int Xoff = int(xblk * img.pagesize.x * scl + 0.5);
-    int Yoff = int(yblk * img.pagesize.y * scl + 0.5);
-    int readszx = int(img.pagesize.x * scl + 0.5);
-    int readszy = int(img.pagesize.y * scl + 0.5);
+    int Xoff = int(tx0 * img.pagesize.x * scl + 0.5);
+    int Yoff = int(ty0 * img.pagesize.y * scl + 0.5);
+    int readszx = int(nx * img.pagesize.x * scl + 0.5);
+    int readszy = int(ny * img.pagesize.y * scl + 0.5);
+    // Line size of the read buffer, in pixels
+    int linesz = nx * img.pagesize.x;
 
     // Compare with the full size and clip to the right and bottom if needed
     int clip=0;
@@ -454,48 +499,131 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
         readszy = poDS->full.size.y - Yoff;
     }
 
-    // This is where the whole page fits
-    void *ob = buffer;
-    if (cstride != 1)
-        ob = poDS->GetPBuffer();
-
-    // Fill buffer with NoData if clipping
+    // Fill buffer with NoData if clipping, all the bands
+    const size_t rsize = static_cast<size_t>(img.pageSizeBytes) * nx * ny;
     if (clip)
-        FillBlock(ob);
+        for (int c = 0; c < cstride * nb; c++) {
+            int hasNoData = 0;
+            // All the bands when reading them together, otherwise the bands of this page
+            GDALRasterBand *b = (cstride == 1) ? ((nb == 1) ? this : poDS->GetRasterBand(c + 1))
+                : poDS->GetRasterBand((nBand - 1) / cstride * cstride + c + 1);
+            double ndv = b->GetNoDataValue(&hasNoData);
+            if (!hasNoData)
+                ndv = 0.0;
+            GDALCopyWords(&ndv, GDT_Float64, 0,
+                static_cast<char *>(buffer) + ((cstride != 1) ? c * vsz : c * rsize),
+                eDataType, vsz * cstride, static_cast<int>(rsize / (vsz * cstride)));
+        }
 
     // Use the dataset RasterIO to read one or all bands if interleaved
-    CPLErr ret = poSrcDS->RasterIO(GF_Read, Xoff, Yoff, readszx, readszy,
-        ob, pcount(readszx, int(scl)), pcount(readszy, int(scl)),
-        eDataType, cstride, (1 == cstride)? &nBand: NULL,
+    return poSrcDS->RasterIO(GF_Read, Xoff, Yoff, readszx, readszy,
+        buffer, pcount(readszx, int(scl)), pcount(readszy, int(scl)),
+        eDataType, cstride * nb, (1 == cstride && 1 == nb)? &nBand: NULL,
         vsz * cstride,  // pixel, line, band stride
-        vsz * cstride * img.pagesize.x,
-        (cstride != 1) ? vsz : vsz * img.pagesize.x * img.pagesize.y
+        vsz * cstride * linesz,
+        (cstride != 1) ? vsz : vsz * linesz * ny * img.pagesize.y
 #if GDAL_VERSION_MAJOR >= 2
         ,NULL
 #endif
         );
+}
 
-    if (ret != CE_None) return ret;
-
-    // Might have the block in the pbuffer, mark it anyhow
-    poDS->tile = req;
-    buf_mgr filesrc;
-    filesrc.buffer = (char *)ob;
-    filesrc.size = static_cast<size_t>(img.pageSizeBytes);
-
-    if (poDS->bypass_cache) { // No local caching, just return the data
-        if (1 == cstride)
-            return CE_None;
-        return RB(xblk, yblk, filesrc, buffer);
+/**
+*\brief Range of tiles to fetch from the source in a single read, in tiles of this level
+*
+*  By default the range covers the source blocks under the requested tile, so each
+*  source block gets decoded only once.  The FETCH_REGION option sets instead the size
+*  of an aligned square of tiles.  The range is then reduced to the tiles not yet in
+*  the cache, the requested tile is always included
+*
+*/
+void GDALMRFRasterBand::FetchRegion(GDALDataset *poSrcDS, double scl, int xblk, int yblk,
+                                    int &tx0, int &ty0, int &nx, int &ny)
+{
+    tx0 = xblk;
+    ty0 = yblk;
+    nx = ny = 1;
+
+    int tx1 = xblk + 1, ty1 = yblk + 1;
+    int n = atoi(poDS->GetOptionValue("FETCH_REGION", "0"));
+    if (n > 0) {
+        n = std::min(n, MAX_FETCH_REGION);
+        tx0 = xblk / n * n;
+        ty0 = yblk / n * n;
+        tx1 = tx0 + n;
+        ty1 = ty0 + n;
     }
+    else {
+        int bx, by;
+        poSrcDS->GetRasterBand(1)->GetBlockSize(&bx, &by);
+        // Tile footprint in source pixels
+        GIntBig fx = static_cast<GIntBig>(img.pagesize.x * scl + 0.5);
+        GIntBig fy = static_cast<GIntBig>(img.pagesize.y * scl + 0.5);
+        if (bx <= 0 || by <= 0 || fx <= 0 || fy <= 0)
+            return;
+        // Source blocks under the tile, then the tiles fully inside those blocks
+        GIntBig bx0 = xblk * fx / bx, bx1 = ((xblk + 1) * fx + bx - 1) / bx;
+        GIntBig by0 = yblk * fy / by, by1 = ((yblk + 1) * fy + by - 1) / by;
+        tx0 = std::min(xblk, static_cast<int>((bx0 * bx + fx - 1) / fx));
+        ty0 = std::min(yblk, static_cast<int>((by0 * by + fy - 1) / fy));
+        tx1 = std::max(xblk + 1, static_cast<int>(std::min(bx1 * bx / fx, GIntBig(INT_MAX))));
+        ty1 = std::max(yblk + 1, static_cast<int>(std::min(by1 * by / fy, GIntBig(INT_MAX))));
+        // Stripped sources could be very wide, limit it around the requested tile
+        if (tx1 - tx0 > MAX_FETCH_REGION) {
+            tx0 = std::max(tx0, xblk - MAX_FETCH_REGION / 2);
+            tx1 = std::min(tx1, tx0 + MAX_FETCH_REGION);
+        }
+        if (ty1 - ty0 > MAX_FETCH_REGION) {
+            ty0 = std::max(ty0, yblk - MAX_FETCH_REGION / 2);
+            ty1 = std::min(ty1, ty0 + MAX_FETCH_REGION);
+        }
+    }
+    tx1 = std::min(tx1, img.pagecount.x);
+    ty1 = std::min(ty1, img.pagecount.y);
+
+    // Shrink to the tiles which are not in the cache yet
+    int mx0 = xblk, mx1 = xblk + 1, my0 = yblk, my1 = yblk + 1;
+    const int pc = (nBand - 1) / img.pagesize.c;
+    for (int y = ty0; y < ty1; y++)
+        for (int x = tx0; x < tx1; x++) {
+            ILIdx tinfo;
+            if (x == xblk && y == yblk)
+                continue;
+            if (CE_None != poDS->ReadTileIdx(tinfo, ILSize(x, y, 0, pc, m_l), img)) {
+                tx0 = xblk; // Just the requested tile
+                ty0 = yblk;
+                return;
+            }
+            if (tinfo.size != 0 || tinfo.offset != 0
+                || !poDS->AdmitTile(IdxOffset(ILSize(x, y, 0, pc, m_l), img), false))
+                continue;
+            mx0 = std::min(mx0, x);
+            mx1 = std::max(mx1, x + 1);
+            my0 = std::min(my0, y);
+            my1 = std::max(my1, y + 1);
+        }
+
+    tx0 = mx0;
+    ty0 = my0;
+    nx = mx1 - mx0;
+    ny = my1 - my0;
+}
 
+/**
+*\brief Store a page fetched from the source in the local cache
+*
+*  The page holds all the bands, pixel interleaved if needed.
+*  Pages with no data are marked as checked, without storing the data
+*
+*/
+CPLErr GDALMRFRasterBand::CachePage(GUIntBig infooffset, void *page)
+{
     // Test to see if it needs to be written, or just marked as checked
     int success;
     double val = GetNoDataValue(&success);
     if (!success) val = 0.0;
 
-    // TODO: test band by band if data is interleaved
-    if (isAllVal(eDataType, ob, img.pageSizeBytes, val)) {
+    if (isAllVal(eDataType, page, img.pageSizeBytes, val)) {
         // Mark it empty and checked, ignore the possible write error
         poDS->WriteTile((void *)1, infooffset, 0);
         return CE_None;
@@ -513,22 +641,205 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
         return CE_Failure;
     }
 
-    buf_mgr filedst={(char *)outbuff, poDS->pbsize};
-    Compress(filedst, filesrc);
-
+    buf_mgr filesrc = {(char *)page, static_cast<size_t>(img.pageSizeBytes)};
+    buf_mgr filedst = {(char *)outbuff, poDS->pbsize};
     // Where the output is, in case we deflate
     void *usebuff = outbuff;
-    if (deflatep) {
-        usebuff = DeflateBlock( filedst, poDS->pbsize - filedst.size, deflate_flags);
-        if (!usebuff) {
-            CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
-            return CE_Failure;
-        }
+    {   // The codec state is shared by the threads storing pages of this band
+        CPLMutexHolderD(&hEncodeMutex);
+        Compress(filedst, filesrc);
+        if (deflatep)
+            usebuff = DeflateBlock( filedst, poDS->pbsize - filedst.size, deflate_flags);
+    }
+    if (!usebuff) {
+        CPLFree(outbuff);
+        CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
+        return CE_Failure;
     }
 
     // Write and update the tile index
-    ret = poDS->WriteTile(usebuff, infooffset, filedst.size);
+    CPLErr ret = poDS->WriteTile(usebuff, infooffset, filedst.size);
     CPLFree(outbuff);
+    if (ret == CE_None) {
+        poDS->TouchTile(infooffset);
+        poDS->CacheStored(filedst.size);
+    }
+    return ret;
+}
+
+/**
+*\brief Are the tiles of the level below which cover this overview tile all in the local cache
+*
+*  Tiles checked and found empty count as cached
+*
+*/
+bool GDALMRFRasterBand::ChildrenCached(int xblk, int yblk)
+{
+    for (int y = 2 * yblk; y < 2 * yblk + 2; y++)
+        for (int x = 2 * xblk; x < 2 * xblk + 2; x++) {
+            int cached = poDS->TileCached(nBand, m_l - 1, x, y);
+            // Outside of the level below is fine, for the last row and column
+            if (cached == 0 || (cached < 0 && x == 2 * xblk && y == 2 * yblk))
+                return false;
+        }
+    return true;
+}
+
+/**
+*\brief Fetch a block from the backing store dataset and keep a copy in the cache
+*
+*  When caching, the neighboring tiles missing from the cache are read from the
+*  source in the same request and stored too, see FetchRegion
+*
+* @param xblk The X block number, zero based
+* @param yblk The Y block number, zero based
+* @param buffer buffer
+*
+*/
+CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
+{
+    assert(!poDS->source.empty());
+    CPLDebug("MRF_IB", "FetchBlock %d,%d,0,%d, level  %d\n", xblk, yblk, nBand, m_l);
+
+    if (poDS->clonedSource)  // This is a clone
+        return FetchClonedBlock(xblk, yblk, buffer);
+
+    const GInt32 cstride = img.pagesize.c; // 1 if band separate
+    ILSize req(xblk, yblk, 0, (nBand-1) / cstride, m_l);
+    GUIntBig infooffset = IdxOffset(req, img);
+
+    // Overview tile, build it from the level below when those tiles are all in the cache
+    if (m_l && poDS->CacheOverviewMode() != SAMPLING_ERR && ChildrenCached(xblk, yblk))
+        return SynthesizeBlock(xblk, yblk, buffer, poDS->CacheOverviewMode());
+
+    // The source failed recently for this tile, don't try again yet
+    if (poDS->FetchFailed(infooffset)) {
+        CPLError(CE_Warning, CPLE_AppDefined,
+            "MRF: Recent failure of source %s, returning NoData", poDS->source.c_str());
+        return FillBlock(buffer);
+    }
+
+    GDALDataset *poSrcDS = NULL;
+    if ( NULL == (poSrcDS = poDS->GetSrcDS())) {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "MRF: Can't open source file %s", poDS->source.c_str());
+        return CE_Failure;
+    }
+
+    // Scale to base resolution
+    double scl = pow(poDS->scale, m_l);
+    if ( 0 == m_l )
+        scl = 1; // To allow for precision issues
+
+    // This is where the whole page fits
+    void *ob = buffer;
+    if (cstride != 1)
+        ob = poDS->GetPBuffer();
+
+    // Store the tile only if it passes the admission policy
+    bool store = !poDS->bypass_cache && poDS->AdmitTile(infooffset);
+
+    // Tiles to read, more than one only when storing
+    // A region is read in a separate buffer, the pages are extracted afterwards
+    int tx0 = xblk, ty0 = yblk, nx = 1, ny = 1;
+    const size_t pbytes = static_cast<size_t>(img.pageSizeBytes);
+    void *rb = ob;
+    if (store)
+        FetchRegion(poSrcDS, scl, xblk, yblk, tx0, ty0, nx, ny);
+
+    // A band separate cache of a pixel interleaved source gets all the bands at once,
+    // otherwise each source page would be read once for every band
+    int nb = 1;
+    if (store && 1 == cstride && poDS->nBands > 1 && poSrcDS->GetRasterCount() == poDS->nBands) {
+        const char *pszInterleave = poSrcDS->GetMetadataItem("INTERLEAVE", "IMAGE_STRUCTURE");
+        if (pszInterleave && EQUAL(pszInterleave, "PIXEL"))
+            nb = poDS->nBands;
+    }
+
+    if (nx * ny * nb > 1) {
+        rb = VSIMalloc(pbytes * nx * ny * nb);
+        if (!rb) { // Not critical, read only the requested tile
+            tx0 = xblk;
+            ty0 = yblk;
+            nx = ny = nb = 1;
+            rb = ob;
+        }
+    }
+
+    CPLErr ret = ReadSource(poSrcDS, tx0, ty0, nx, ny, rb, nb > 1);
+
+    if (ret != CE_None) {
+        if (rb != ob)
+            CPLFree(rb);
+        poDS->FetchFailure(infooffset);
+        return ret;
+    }
+
+    // Extract and cache the other pages of the region, then the requested one
+    // When reading all bands, the regions of each band follow each other
+    if (rb != ob) {
+        const size_t line = size_t(img.pagesize.x) * cstride * (GDALGetDataTypeSize(eDataType) / 8);
+        void *page = VSIMalloc(pbytes);
+        for (int b = 0; b < nb; b++) {
+            GDALMRFRasterBand *band = this;
+            int c = req.c;
+            if (nb > 1) {
+                c = b;
+                band = static_cast<GDALMRFRasterBand *>(poDS->GetRasterBand(b + 1));
+                if (band->GetOverviewCount() && m_l)
+                    band = static_cast<GDALMRFRasterBand *>(band->GetOverview(m_l - 1));
+                if (!band)
+                    continue;
+            }
+            const char *src = static_cast<char *>(rb) + b * pbytes * nx * ny;
+            for (int y = 0; y < ny; y++)
+                for (int x = 0; x < nx; x++) {
+                    const char *tsrc = src + size_t(y) * img.pagesize.y * nx * line + x * line;
+                    if (tx0 + x == xblk && ty0 + y == yblk && c == req.c) {
+                        for (int l = 0; l < img.pagesize.y; l++)
+                            memcpy(static_cast<char *>(ob) + l * line, tsrc + size_t(l) * nx * line, line);
+                        continue;
+                    }
+                    if (!page)
+                        continue;
+                    // Only the tiles not in the cache and not being fetched by others, ignore errors
+                    // The region can include tiles already cached, those are left alone
+                    ILSize pos(tx0 + x, ty0 + y, 0, c, m_l);
+                    GUIntBig offset = IdxOffset(pos, img);
+                    if (!poDS->ClaimFetch(offset, false))
+                        continue;
+                    void *hLock = NULL;
+                    ILIdx tinfo;
+                    if (poDS->AdmitTile(offset, false) && poDS->LockFetch(offset, &hLock, false)
+                        && CE_None == poDS->ReadTileIdx(tinfo, pos, img)
+                        && 0 == tinfo.size && 0 == tinfo.offset && !poDS->PendingPage(offset, NULL)) {
+                        for (int l = 0; l < img.pagesize.y; l++)
+                            memcpy(static_cast<char *>(page) + l * line, tsrc + size_t(l) * nx * line, line);
+                        if (!poDS->QueuePage(band, offset, page))
+                            band->CachePage(offset, page);
+                    }
+                    GDALMRFDataset::UnlockFetch(hLock);
+                    poDS->ReleaseFetch(offset);
+                }
+        }
+        CPLFree(page);
+        CPLFree(rb);
+    }
+
+    // Might have the block in the pbuffer, mark it anyhow
+    poDS->tile = req;
+    buf_mgr filesrc;
+    filesrc.buffer = (char *)ob;
+    filesrc.size = static_cast<size_t>(img.pageSizeBytes);
+
+    if (!store) { // No local caching, just return the data
+        if (1 == cstride)
+            return CE_None;
+        return RB(xblk, yblk, filesrc, buffer);
+    }
+
+    if (!poDS->QueuePage(this, infooffset, ob))
+        ret = CachePage(infooffset, ob);
 
     // If we hit an error or if unpaking is not needed
     if (ret != CE_None || cstride == 1)
@@ -606,6 +917,13 @@ CPLErr GDALMRFRasterBand::FetchClonedBlock(int xblk, int yblk, void *buffer)
                  tinfo.size);
         return CE_Failure;
     }
+
+    // Local files might be copied directly, without reading the tile
+    if (CE_None == poDS->CopyClonedTile(poSrc, tinfo, infooffset)) {
+        poDS->CacheStored(tinfo.size);
+        return IReadBlock(xblk, yblk, buffer);
+    }
+
     char *buf = static_cast<char *>(VSIMalloc(static_cast<size_t>(tinfo.size)));
     if( buf == NULL )
     {
@@ -627,10 +945,74 @@ CPLErr GDALMRFRasterBand::FetchClonedBlock(int xblk, int yblk, void *buffer)
     CPLFree(buf);
     if ( CE_None != err )
         return err;
+    poDS->CacheStored(tinfo.size);
     // Reissue read, it will work from the cloned data
     return IReadBlock(xblk, yblk, buffer);
 }
 
+/**
+*\brief Build a missing overview block from the level below
+*
+*  The level below is read through the bands, so missing tiles there get built
+*  recursively.  If SYNTHESIZE_PERSIST is set, the page is stored, or marked
+*  as checked if it holds no data, so it doesn't have to be built again.
+*  Caching MRFs store the page the same way as a fetched one
+*
+* @param xblk The X block number, zero based
+* @param yblk The Y block number, zero based
+* @param buffer buffer
+* @param sampling_mode The internal sampling method
+*
+*/
+
+CPLErr GDALMRFRasterBand::SynthesizeBlock(int xblk, int yblk, void *buffer, int sampling_mode)
+{
+    CPLDebug("MRF_IB", "SynthesizeBlock %d,%d,0,%d, level  %d\n", xblk, yblk, nBand, m_l);
+
+    const GInt32 cstride = img.pagesize.c;
+    void *page = VSIMalloc(img.pageSizeBytes);
+    if (!page) {
+        CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate synthesis buffer");
+        return CE_Failure;
+    }
+
+    CPLErr ret = poDS->SynthesizePage(this, xblk, yblk, page, sampling_mode);
+    if (ret != CE_None) {
+        CPLFree(page);
+        return ret;
+    }
+
+    // Return the data before storing it, the write might swab the page
+    buf_mgr src = {(char *)page, static_cast<size_t>(img.pageSizeBytes)};
+    if (1 == cstride)
+        memcpy(buffer, page, img.pageSizeBytes);
+    else {
+        memcpy(poDS->GetPBuffer(), page, img.pageSizeBytes);
+        src.buffer = (char *)poDS->GetPBuffer();
+        ret = RB(xblk, yblk, src, buffer);
+    }
+
+    GUIntBig infooffset = IdxOffset(ILSize(xblk, yblk, 0, (nBand-1)/cstride, m_l), img);
+    if (ret == CE_None && !poDS->source.empty()) {
+        // Caching MRF, store it as if it was fetched
+        if (!poDS->bypass_cache && poDS->AdmitTile(infooffset) && !poDS->QueuePage(this, infooffset, page))
+            ret = CachePage(infooffset, page);
+    }
+    else if (ret == CE_None && poDS->SynthPersist() && IdxMode() == GF_Write && DataMode() == GF_Write) {
+        int success;
+        double val = GetNoDataValue(&success);
+        if (!success) val = 0.0;
+        // Mark it empty and checked, or store it, ignore the possible write error
+        if (isAllVal(eDataType, page, img.pageSizeBytes, val))
+            poDS->WriteTile((void *)1, infooffset, 0);
+        else
+            WritePage(xblk, yblk, page);
+    }
+
+    CPLFree(page);
+    return ret;
+}
+
 /**
 *\brief read a block in the provided buffer
 *
@@ -659,6 +1041,10 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
     }
 
     if (0 == tinfo.size) { // Could be missing or it could be caching
+        // Missing overview tile, it can be built from the level below
+        if (0 == tinfo.offset && 0 != m_l && poDS->SynthMode() != SAMPLING_ERR)
+            return SynthesizeBlock(xblk, yblk, buffer, poDS->SynthMode());
+
         // Offset != 0 means no data, Update mode is for local MRFs only
         // if caching index mode is RO don't try to fetch
         // Also, caching MRFs can't be opened in update mode
@@ -667,10 +1053,77 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
             return FillBlock(buffer);
 
         // caching MRF, need to fetch a block
-        return FetchBlock(xblk, yblk, buffer);
+        // If it was fetched but not written yet, use the queued page
+        GUIntBig infooffset = IdxOffset(req, img);
+        void *ob = (1 == cstride) ? buffer : poDS->GetPBuffer();
+        if (poDS->PendingPage(infooffset, ob)) {
+            if (1 == cstride)
+                return CE_None;
+            buf_mgr src = {(char *)ob, static_cast<size_t>(img.pageSizeBytes)};
+            return RB(xblk, yblk, src, buffer);
+        }
+
+        // If another thread is already fetching it, wait for it and read again
+        if (!poDS->ClaimFetch(infooffset))
+            return IReadBlock(xblk, yblk, buffer);
+
+        // Then do the same with other processes, if enabled
+        // If another process is still fetching it after the wait, return fill
+        void *hLock = NULL;
+        bool stored = false; // By another process, while waiting
+        CPLErr ret;
+        if (!poDS->LockFetch(infooffset, &hLock))
+            ret = FillBlock(buffer);
+        else {
+            if (hLock && CE_None == poDS->ReadTileIdx(tinfo, req, img))
+                stored = (0 != tinfo.size || 0 != tinfo.offset);
+            ret = stored ? CE_None : FetchBlock(xblk, yblk, buffer);
+        }
+
+        GDALMRFDataset::UnlockFetch(hLock);
+        poDS->ReleaseFetch(infooffset);
+        return stored ? IReadBlock(xblk, yblk, buffer) : ret;
     }
 
     CPLDebug("MRF_IB","Tinfo offset " CPL_FRMT_GIB ", size  " CPL_FRMT_GIB "\n", tinfo.offset, tinfo.size);
+
+    // If pages are interleaved, use the dataset page buffer instead
+    void *ob = buffer;
+    if (1 != cstride)
+        ob = poDS->GetPBuffer();
+
+    CPLErr ret = ReadPage(tinfo, ob);
+
+    // Keep track of the cached tile use
+    if (ret == CE_None && !poDS->source.empty())
+        poDS->TouchTile(IdxOffset(req, img));
+
+    // If pages are separate, we're done, the read was in the output buffer
+    if ( 1 == cstride || CE_None != ret)
+        return ret;
+
+    // De-interleave page and return
+    buf_mgr dst = {(char *)ob, static_cast<size_t>(img.pageSizeBytes)};
+    return RB(xblk, yblk, dst, buffer);
+}
+
+/**
+*\brief Read and decode a stored page in the provided buffer
+*
+*  The buffer has to hold img.pageSizeBytes, it receives all the bands of the page,
+*  pixel interleaved if the page holds more than one band
+*  tinfo is the index record of the page, in native byte order
+*  If denom is not 1, the page is decoded at a reduced resolution, which only works if
+*  CanDecompressReduced() is true
+*  z is the slice of the page, the current one if negative
+*
+*/
+
+CPLErr GDALMRFRasterBand::ReadPage(const ILIdx &tinfo, void *buffer, int denom, int z)
+{
+    // Size of the data, changes if the page is inflated
+    GIntBig tsize = tinfo.size;
+
     // If we have a tile, read it
 
     // Should use a permanent buffer, like the pbuffer mechanism
@@ -701,28 +1154,51 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
         return CE_Failure;
     }
 
-    VSILFILE *dfp = DataFP();
-
-    // No data file to read from
-    if (dfp == NULL)
+    // This part is not thread safe, but it is what GDAL expects
+    // The lock keeps the background threads from moving the file pointer
+    bool readok = false;
     {
-        CPLFree(data);
-        return CE_Failure;
+        CPLMutexHolderD(poDS->IOMutex());
+        VSILFILE *dfp = DataFP();
+
+        // No data file to read from
+        if (dfp == NULL)
+        {
+            CPLFree(data);
+            return CE_Failure;
+        }
+
+        VSIFSeekL(dfp, tinfo.offset, SEEK_SET);
+        readok = (1 == VSIFReadL(data, static_cast<size_t>(tinfo.size), 1, dfp));
     }
 
-    // This part is not thread safe, but it is what GDAL expects
-    VSIFSeekL(dfp, tinfo.offset, SEEK_SET);
-    if (1 != VSIFReadL(data, static_cast<size_t>(tinfo.size), 1, dfp)) {
+    if (!readok) {
         CPLFree(data);
         CPLError(CE_Failure, CPLE_AppDefined, "Unable to read data page, %d@%x",
             int(tinfo.size), int(tinfo.offset));
         return CE_Failure;
     }
 
+    // The tiles of a Z delta coded slice end with the record of the key tile, which
+    // is empty if the tile is stored as it is
+    ILIdx key = { 0, 0 };
+    const int zkey = poDS->ZDeltaKey(z);
+    if (zkey >= 0) {
+        if (tsize < GIntBig(ZDELTA_TRAILER) || 0 != memcmp((char *)data + tsize - 8, ZDELTA_SIG, 8)) {
+            CPLFree(data);
+            CPLError(CE_Failure, CPLE_AppDefined, "MRF: Z delta coded tile is corrupt");
+            return CE_Failure;
+        }
+        tsize -= ZDELTA_TRAILER;
+        memcpy(&key, (char *)data + tsize, sizeof(ILIdx));
+        key.offset = net64(key.offset);
+        key.size = net64(key.size);
+    }
+
     /* initialize padding bytes */
-    memset(((char*)data) + static_cast<size_t>(tinfo.size), 0, 3);
+    memset(((char*)data) + static_cast<size_t>(tsize), 0, 3);
 
-    buf_mgr src = {(char *)data, static_cast<size_t>(tinfo.size)};
+    buf_mgr src = {(char *)data, static_cast<size_t>(tsize)};
     buf_mgr dst;
 
     // We got the data, do we need to decompress it before decoding?
@@ -747,7 +1223,7 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
         if (ZUnPack(src, dst, deflate_flags)) {
             // Got it unpacked, update the pointers
             CPLFree(data);
-            tinfo.size = dst.size;
+            tsize = dst.size;
             data = dst.buffer;
         } else { // Warn and assume the data was not deflated
             CPLError(CE_Warning, CPLE_AppDefined, "Can't inflate page!");
@@ -756,30 +1232,168 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
     }
 
     src.buffer = (char *)data;
-    src.size = static_cast<size_t>(tinfo.size);
+    src.size = static_cast<size_t>(tsize);
 
-    // After unpacking, the size has to be pageSizeBytes
+    // After unpacking, the size has to be pageSizeBytes, reduced if needed
+    size_t pageSize = static_cast<size_t>(img.pageSizeBytes) / (denom * denom);
     dst.buffer = (char *)buffer;
-    dst.size = img.pageSizeBytes;
+    dst.size = pageSize;
 
-    // If pages are interleaved, use the dataset page buffer instead
-    if (1!=cstride)
-        dst.buffer = (char *)poDS->GetPBuffer();
-
-    CPLErr ret = Decompress(dst, src);
-    dst.size = img.pageSizeBytes; // In case the decompress failed, force it back
+    CPLErr ret = (1 == denom) ? Decompress(dst, src) : DecompressReduced(dst, src, denom);
+    dst.size = pageSize; // In case the decompress failed, force it back
     CPLFree(data);
 
     // Swap whatever we decompressed if we need to
     if (is_Endianess_Dependent(img.dt,img.comp) && (img.nbo != NET_ORDER) )
         swab_buff(dst, img);
 
-    // If pages are separate, we're done, the read was in the output buffer
-    if ( 1 == cstride || CE_None != ret)
-        return ret;
+    // Add the key page back, the key tile data is never overwritten
+    if (CE_None == ret && 0 != key.size) {
+        void *kpage = VSIMalloc(pageSize);
+        ret = kpage ? ReadPage(key, kpage, denom, zkey) : CE_Failure;
+        if (CE_None == ret)
+            ZDeltaFilter(img.dt, buffer, kpage, pageSize, false);
+        CPLFree(kpage);
+    }
 
-    // De-interleave page and return
-    return RB(xblk, yblk, dst, buffer);
+    return ret;
+}
+
+/**
+*\brief Encode and write a full page from the provided buffer
+*
+*  The buffer holds img.pageSizeBytes, all the bands of the page, pixel interleaved
+*  if the page holds more than one band.  It bypasses the block cache, so it is
+*  up to the caller to keep the cache coherent.
+*  The buffer content might be modified if byte swapping is needed, Z delta coding
+*  works on a copy
+*
+*/
+
+CPLErr GDALMRFRasterBand::WritePage(int xblk, int yblk, void *buffer)
+{
+    GInt32 cstride = img.pagesize.c;
+    ILSize req(xblk, yblk, 0, (nBand-1)/cstride, m_l);
+    GUIntBig infooffset = IdxOffset(req, img);
+
+    CPLDebug("MRF_IB", "WritePage %d,%d,0,%d, level  %d, stride %d\n", xblk, yblk,
+        nBand, m_l, cstride);
+
+    // Empty page, just write the index record
+    int success;
+    double val = GetNoDataValue(&success);
+    if (!success) val = 0.0;
+    if (isAllVal(eDataType, buffer, img.pageSizeBytes, val))
+        return poDS->WriteTile(NULL, infooffset, 0);
+
+    // Have to use a separate buffer for compression output
+    void *outbuff = VSIMalloc(poDS->pbsize);
+    if (!outbuff) {
+        CPLError(CE_Failure, CPLE_AppDefined,
+            "MRF: Can't get buffer for writing page");
+        return CE_Failure;
+    }
+
+    buf_mgr src = {(char *)buffer, static_cast<size_t>(img.pageSizeBytes)};
+    buf_mgr dst = {(char *)outbuff, poDS->pbsize};
+
+    // Z delta coding happens before swapping, on a copy, the callers reuse the page
+    ILIdx key = { 0, 0 };
+    void *zbuff = NULL;
+    if (poDS->ZDeltaKey() >= 0 && NULL != (zbuff = VSIMalloc(src.size))) {
+        memcpy(zbuff, buffer, src.size);
+        ZDeltaEncode(infooffset, zbuff, key);
+        src.buffer = (char *)zbuff;
+    }
+
+    // Swab the source before encoding if we need to
+    if (is_Endianess_Dependent(img.dt, img.comp) && (img.nbo != NET_ORDER))
+        swab_buff(src, img);
+
+    // Compress functions need to return the compressed size in
+    // the bytes in buffer field
+    Compress(dst, src);
+    CPLFree(zbuff);
+    void *usebuff = outbuff;
+    if (deflatep) {
+        usebuff = DeflateBlock(dst, poDS->pbsize - dst.size, deflate_flags);
+        if (!usebuff) {
+            CPLFree(outbuff);
+            CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
+            return CE_Failure;
+        }
+    }
+
+    CPLErr ret = ZWriteTile(usebuff, infooffset, dst.size, key);
+    CPLFree(outbuff);
+    return ret;
+}
+
+/**
+*\brief For Z delta MRFs, replace the page with its difference from the same page of the key slice
+*
+*  The page holds img.pageSizeBytes, it gets modified in place.  If the current slice is
+*  not Z delta coded, or if the key tile is empty, the page is not changed and the key size is zero
+*
+*/
+
+void GDALMRFRasterBand::ZDeltaEncode(GUIntBig infooffset, void *page, ILIdx &key)
+{
+    key.offset = 0;
+    key.size = 0;
+    int zkey = poDS->ZDeltaKey();
+    if (zkey < 0)
+        return;
+
+    // Same tile in the key slice, the slices follow each other in the index
+    GIntBig keyoffset = infooffset
+        - (poDS->zslice - zkey) * (sizeof(ILIdx) * img.pagecount.l / img.size.z);
+    {
+        CPLMutexHolderD(poDS->IOMutex());
+        VSILFILE *l_ifp = poDS->IdxFP();
+        if (l_ifp == NULL)
+            return;
+        VSIFSeekL(l_ifp, keyoffset, SEEK_SET);
+        if (1 != VSIFReadL(&key, sizeof(ILIdx), 1, l_ifp))
+            key.size = 0;
+    }
+    key.offset = net64(key.offset);
+    key.size = net64(key.size);
+    if (key.size == 0) {
+        key.offset = 0;
+        return;
+    }
+
+    void *kpage = VSIMalloc(static_cast<size_t>(img.pageSizeBytes));
+    if (kpage == NULL || CE_None != ReadPage(key, kpage, 1, zkey)) {
+        // Store it as it is
+        key.offset = 0;
+        key.size = 0;
+    }
+    else
+        ZDeltaFilter(img.dt, page, kpage, static_cast<size_t>(img.pageSizeBytes), true);
+    CPLFree(kpage);
+}
+
+// Write a tile, the tiles of Z delta coded slices get the trailer with the key tile record
+// The key record is empty when the tile is stored as it is
+CPLErr GDALMRFRasterBand::ZWriteTile(void *buff, GUIntBig infooffset, GUIntBig size, const ILIdx &key)
+{
+    if (poDS->ZDeltaKey() < 0)
+        return poDS->WriteTile(buff, infooffset, size);
+
+    char *tbuff = reinterpret_cast<char *>(VSIMalloc(static_cast<size_t>(size) + ZDELTA_TRAILER));
+    if (tbuff == NULL) {
+        CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate write buffer");
+        return CE_Failure;
+    }
+    memcpy(tbuff, buff, static_cast<size_t>(size));
+    ILIdx nkey = { GIntBig(net64(key.offset)), GIntBig(net64(key.size)) };
+    memcpy(tbuff + size, &nkey, sizeof(ILIdx));
+    memcpy(tbuff + size + sizeof(ILIdx), ZDELTA_SIG, 8);
+    CPLErr ret = poDS->WriteTile(tbuff, infooffset, size + ZDELTA_TRAILER);
+    CPLFree(tbuff);
+    return ret;
 }
 
 /**
@@ -802,6 +1416,9 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
     CPLDebug("MRF_IB", "IWriteBlock %d,%d,0,%d, level  %d, stride %d\n", xblk, yblk,
         nBand, m_l, cstride);
 
+    // The overview tiles above this one are now stale
+    poDS->MarkDirty(xblk, yblk, m_l);
+
     if (1 == cstride) {     // Separate bands, we can write it as is
         // Empty page skip
 
@@ -819,6 +1436,15 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
         src.size = static_cast<size_t>(img.pageSizeBytes);
         buf_mgr dst = {(char *)poDS->GetPBuffer(), poDS->GetPBufferSize()};
 
+        // Z delta coding works on a copy, the buffer belongs to the block cache
+        ILIdx key = { 0, 0 };
+        void *zbuff = NULL;
+        if (poDS->ZDeltaKey() >= 0 && NULL != (zbuff = VSIMalloc(src.size))) {
+            memcpy(zbuff, buffer, src.size);
+            ZDeltaEncode(infooffset, zbuff, key);
+            src.buffer = (char *)zbuff;
+        }
+
         // Swab the source before encoding if we need to
         if (is_Endianess_Dependent(img.dt, img.comp) && (img.nbo != NET_ORDER))
             swab_buff(src, img);
@@ -826,6 +1452,7 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
         // Compress functions need to return the compressed size in
         // the bytes in buffer field
         Compress(dst, src);
+        CPLFree(zbuff);
         void *usebuff = dst.buffer;
         if (deflatep) {
             usebuff = DeflateBlock(dst, poDS->pbsize - dst.size, deflate_flags);
@@ -834,7 +1461,7 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
                 return CE_Failure;
             }
         }
-        return poDS->WriteTile(usebuff, infooffset , dst.size);
+        return ZWriteTile(usebuff, infooffset , dst.size, key);
     }
 
     // Multiple bands per page, use a temporary to assemble the page
@@ -931,6 +1558,9 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
     src.buffer = (char *)tbuffer;
     src.size = static_cast<size_t>(img.pageSizeBytes);
 
+    ILIdx key;
+    ZDeltaEncode(infooffset, tbuffer, key);
+
     // Use the space after pagesizebytes for compressed output, it is of pbsize
     char *outbuff = (char *)tbuffer + img.pageSizeBytes;
 
@@ -961,7 +1591,7 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
         }
     }
 
-    ret = poDS->WriteTile(usebuff, infooffset, dst.size);
+    ret = ZWriteTile(usebuff, infooffset, dst.size, key);
     CPLFree(tbuffer);
 
     poDS->bdirty = 0;
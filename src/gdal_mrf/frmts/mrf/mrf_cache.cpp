@@ -0,0 +1,1324 @@
+/*
+* Copyright 2014-2015 Esri
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+/******************************************************************************
+*
+* Project:  Meta Raster File Format Driver Implementation, caching support
+* Purpose:  Management of the local content of caching and cloned MRFs
+*
+* Author:   Lucian Plesea, Lucian.Plesea@jpl.nasa.gov, lplesea@esri.com
+*
+******************************************************************************
+*  The size of a caching MRF can be bounded with the CACHE_MAX_SIZE option.
+*  The last access time of each tile is kept in a sidecar file, with one 32 bit
+*  value for each index record, written in batches.  When the cached data exceeds the
+*  maximum size, the least recently used tiles are removed from the index, until the
+*  cached data is below 90% of the maximum.  The space they used in the data file is
+*  reclaimed by compaction, when the dataset is closed.
+*
+*  The CACHE_ADMIT option sets how many times a tile has to be requested before it
+*  gets stored, which avoids filling the cache with tiles that are read only once.
+*  The requests are counted in a count-min sketch, the counts are halved at every
+*  CACHE_ADMIT_WINDOW interval.
+*
+*  With the WRITE_BEHIND option, the fetched pages are compressed and stored by a
+*  separate thread, so the reads don't wait for them.  The queue of pages is limited
+*  in size, the reads wait if it is full.  While the thread runs, the index and data
+*  file access is serialized by the IO mutex.
+*
+*  With the FETCH_FAIL_TTL option, source open and read failures are remembered for
+*  that many seconds, within the process.  During that time the affected tiles read as
+*  NoData, with a warning, without trying the source again.  FETCH_FAIL_PERSIST saves
+*  the failures in a sidecar file, so they are shared with other processes.
+*
+*  The CLONE_INDEX option of a cloned MRF copies the source index in a background
+*  thread, in large reads, instead of in small blocks as the records are needed.  The
+*  records are copied only where they are not yet present in the local index.
+*
+*  The CLONE_DIRECT_COPY option lets a cloned MRF copy the tiles from the source data
+*  file to the local one within the kernel, when both are local files.  The copied tiles
+*  are not verified, so it should only be used when a single process writes the clone.
+*
+*  The PARALLEL_FETCH option sets the number of threads which fetch the missing tiles
+*  of a full resolution read window at the same time, each one with its own instance
+*  of the source dataset, from a pool kept open with the MRF.  The read itself proceeds
+*  after the fetches complete.
+****************************************************************************/
+
+#include "marfa.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <ctime>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#endif
+
+CPL_CVSID("$Id$");
+
+using std::vector;
+using std::pair;
+
+NAMESPACE_MRF_START
+
+// Pending access times written at once
+#define ATIME_BATCH 4096
+
+// Eviction stops when the cached data gets below this fraction of the maximum size
+#define CACHE_LOW_WATER 0.9
+
+// Limit for the failures remembered within a process
+#define MAX_FAILURES 65536
+
+// Limit for the PARALLEL_FETCH threads
+#define MAX_FETCH_THREADS 64
+
+//
+// Maximum size of the cached data, zero if not bounded
+// The value is in bytes, with an optional K, M or G suffix
+//
+GIntBig GDALMRFDataset::CacheMaxSize()
+{
+    if (cacheMax >= 0)
+        return cacheMax;
+
+    cacheMax = 0;
+    const char *pszMax = GetOptionValue("CACHE_MAX_SIZE", NULL);
+    if (source.empty() || !pszMax)
+        return cacheMax;
+
+    cacheMax = CPLAtoGIntBig(pszMax);
+    int shift = 0;
+    switch (pszMax[strlen(pszMax) - 1]) {
+    case 'g': case 'G': shift = 30; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'k': case 'K': shift = 10; break;
+    default: break;
+    }
+    cacheMax <<= shift;
+    cacheMax = std::max(cacheMax, GIntBig(0));
+    return cacheMax;
+}
+
+// The access time sidecar, created if needed
+VSILFILE *GDALMRFDataset::AtimeFP()
+{
+    if (atimeFP)
+        return atimeFP;
+
+    CPLString aname = current.idxfname + ".atime";
+    atimeFP = VSIFOpenL(aname, "r+b");
+    if (!atimeFP)
+        atimeFP = VSIFOpenL(aname, "w+b");
+    if (!atimeFP)
+        CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't open access time file %s", aname.c_str());
+    return atimeFP;
+}
+
+// Record the access to a cached tile, infooffset is the index record offset
+// The access times are kept in memory and written in batches, see FlushAtimes
+void GDALMRFDataset::TouchTile(GUIntBig infooffset)
+{
+    if (!CacheMaxSize())
+        return;
+
+    CPLMutexHolderD(IOMutex());
+    atimes[infooffset / sizeof(ILIdx)] = static_cast<GUInt32>(time(NULL));
+    if (atimes.size() >= ATIME_BATCH)
+        FlushAtimes();
+}
+
+// Write the pending access times, in runs of adjacent records
+void GDALMRFDataset::FlushAtimes()
+{
+    CPLMutexHolderD(IOMutex());
+    if (atimes.empty() || !AtimeFP()) {
+        atimes.clear();
+        return;
+    }
+
+    vector<GUInt32> run;
+    std::map<GUIntBig, GUInt32>::iterator it = atimes.begin();
+    while (it != atimes.end()) {
+        GUIntBig first = it->first;
+        run.clear();
+        for (; it != atimes.end() && it->first == first + run.size(); ++it)
+            run.push_back(it->second);
+        VSIFSeekL(atimeFP, first * sizeof(GUInt32), SEEK_SET);
+        VSIFWriteL(&run[0], sizeof(GUInt32), run.size(), atimeFP);
+    }
+    atimes.clear();
+}
+
+//
+// Account for a tile stored in the cache, evict tiles if the cache is over the limit
+// Until the first eviction, the data file size is used instead of the cached data size
+// A single thread evicts at a time, the others keep storing tiles meanwhile
+//
+void GDALMRFDataset::CacheStored(GIntBig size)
+{
+    if (!CacheMaxSize())
+        return;
+
+    {
+        CPLMutexHolderD(IOMutex());
+        if (cacheLive < 0) {
+            VSILFILE *l_dfp = DataFP();
+            if (!l_dfp)
+                return;
+            VSIFSeekL(l_dfp, 0, SEEK_END);
+            if (static_cast<GIntBig>(VSIFTellL(l_dfp)) <= cacheMax)
+                return;
+        }
+        else {
+            cacheLive += size;
+            if (cacheLive <= cacheMax)
+                return;
+        }
+        if (cacheEvicting)
+            return;
+        cacheEvicting = true;
+    }
+
+    EvictTiles();
+    CPLMutexHolderD(IOMutex());
+    cacheEvicting = false;
+}
+
+// A stored tile, for eviction
+struct LiveTile {
+    GUInt32 atime;
+    size_t i;
+    GIntBig offset;
+    GIntBig size;
+    bool operator<(const LiveTile &other) const {
+        return atime < other.atime || (atime == other.atime && i < other.i);
+    }
+};
+
+//
+// Remove the least recently used tiles from the index, until the cached data is
+// below CACHE_LOW_WATER of the maximum size, so it doesn't run again soon
+// The index and the access times are read in chunks through separate file handles,
+// without holding the IO mutex.  The mutex is held only while removing a batch of
+// tiles, the ones stored again in the meantime are skipped
+//
+CPLErr GDALMRFDataset::EvictTiles()
+{
+    {   // The pending writes have to be visible through the separate handles
+        CPLMutexHolderD(IOMutex());
+        if (!IdxFP() || IdxMode() != GF_Write)
+            return CE_Failure;
+        VSIFFlushL(ifp.FP);
+        FlushAtimes();
+        if (atimeFP)
+            VSIFFlushL(atimeFP);
+    }
+
+    VSILFILE *l_ifp = VSIFOpenL(current.idxfname, "rb");
+    if (!l_ifp) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read the cache index");
+        return CE_Failure;
+    }
+    CPLString aname = current.idxfname + ".atime";
+    VSILFILE *l_afp = VSIFOpenL(aname, "rb");
+
+    const size_t CHUNK = 64 * 1024; // records
+    size_t count = static_cast<size_t>(idxSize / sizeof(ILIdx));
+    vector<ILIdx> idx(CHUNK);
+    vector<GUInt32> times(CHUNK);
+
+    // Stored tiles, oldest first
+    vector<LiveTile> live;
+    GIntBig total = 0;
+    for (size_t start = 0; start < count; start += CHUNK) {
+        size_t n = std::min(CHUNK, count - start);
+        VSIFSeekL(l_ifp, start * sizeof(ILIdx), SEEK_SET);
+        if (n != VSIFReadL(&idx[0], sizeof(ILIdx), n, l_ifp)) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read the cache index");
+            VSIFCloseL(l_ifp);
+            if (l_afp)
+                VSIFCloseL(l_afp);
+            return CE_Failure;
+        }
+
+        // Short access time file is fine
+        std::fill(times.begin(), times.end(), 0);
+        if (l_afp) {
+            VSIFSeekL(l_afp, start * sizeof(GUInt32), SEEK_SET);
+            VSIFReadL(&times[0], sizeof(GUInt32), n, l_afp);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            GIntBig sz = net64(idx[i].size);
+            if (sz <= 0)
+                continue;
+            LiveTile t = { times[i], start + i, static_cast<GIntBig>(net64(idx[i].offset)), sz };
+            live.push_back(t);
+            total += sz;
+        }
+    }
+    VSIFCloseL(l_ifp);
+    if (l_afp)
+        VSIFCloseL(l_afp);
+    std::sort(live.begin(), live.end());
+
+    // Remove them in batches, holding the IO mutex for each batch
+    const size_t BATCH = 1024;
+    const GIntBig low = static_cast<GIntBig>(cacheMax * CACHE_LOW_WATER);
+    const ILIdx empty = { 0, 0 };
+    int evicted = 0;
+    CPLErr ret = CE_None;
+    for (size_t k = 0; k < live.size() && total > low && ret == CE_None;) {
+        CPLMutexHolderD(IOMutex());
+        VSILFILE *fp = IdxFP();
+        for (size_t b = 0; b < BATCH && k < live.size() && total > low; b++, k++) {
+            ILIdx tinfo;
+            size_t i = live[k].i;
+            VSIFSeekL(fp, i * sizeof(ILIdx), SEEK_SET);
+            if (1 != VSIFReadL(&tinfo, sizeof(ILIdx), 1, fp)
+                || static_cast<GIntBig>(net64(tinfo.offset)) != live[k].offset)
+                continue; // Changed since the scan
+            total -= live[k].size;
+            VSIFSeekL(fp, i * sizeof(ILIdx), SEEK_SET);
+            if (1 != VSIFWriteL(&empty, sizeof(ILIdx), 1, fp)) {
+                CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't write the cache index");
+                ret = CE_Failure;
+                break;
+            }
+            evicted++;
+        }
+    }
+
+    CPLDebug("MRF_CACHE", "Evicted %d tiles, " CPL_FRMT_GIB " bytes cached\n", evicted, total);
+    CPLMutexHolderD(IOMutex());
+    cacheLive = total;
+    cacheEvicted += evicted;
+    return ret;
+}
+
+#if !defined(_WIN32)
+// Cache lock handle, the open lock file holds the flock
+struct CacheLock {
+    int fd;
+};
+#endif
+
+//
+// Cross process lock on a caching MRF, named as the index file with a .lock extension.
+// The index and data files are opened together holding it shared, while CompactCache
+// holds it exclusive when replacing them.  Returns NULL if it can't be locked
+//
+void *GDALMRFDataset::LockCache(bool exclusive)
+{
+    CPLString lname = current.idxfname;
+#if defined(_WIN32)
+    // The files can't be replaced while open by others, nothing to do when opening
+    return exclusive ? CPLLockFile(lname, 0) : NULL;
+#else
+    lname += ".lock";
+    int fd = open(lname, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return NULL;
+    // flock conflicts between open files, even within the same process
+    if (0 != flock(fd, exclusive ? LOCK_EX : LOCK_SH)) {
+        close(fd);
+        return NULL;
+    }
+    CacheLock *psLock = new CacheLock;
+    psLock->fd = fd;
+    return psLock;
+#endif
+}
+
+void GDALMRFDataset::UnlockCache(void *hLock)
+{
+    if (!hLock)
+        return;
+#if defined(_WIN32)
+    CPLUnlockFile(hLock);
+#else
+    CacheLock *psLock = static_cast<CacheLock *>(hLock);
+    close(psLock->fd);
+    delete psLock;
+#endif
+}
+
+//
+// Reclaim the data file space not used by the tiles in the index, by copying the
+// tiles to a new data file, in order, and writing a matching new index.  The new files
+// replace the current ones together, holding the cache lock exclusively.  Other
+// processes keep using the files they have open until they open the MRF again, the
+// tiles they store in the meantime are lost
+//
+CPLErr GDALMRFDataset::CompactCache()
+{
+    if (source.empty() || clonedSource) {
+        CPLError(CE_Failure, CPLE_NotSupported, "MRF: Only caching MRFs can be compacted");
+        return CE_Failure;
+    }
+
+    CPLMutexHolderD(IOMutex());
+    VSILFILE *l_ifp = IdxFP();
+    VSILFILE *l_dfp = DataFP();
+    if (!l_ifp || !l_dfp || IdxMode() != GF_Write || DataMode() != GF_Write)
+        return CE_Failure;
+
+    size_t count = static_cast<size_t>(idxSize / sizeof(ILIdx));
+    vector<ILIdx> idx(count);
+    VSIFSeekL(l_ifp, 0, SEEK_SET);
+    if (count != VSIFReadL(&idx[0], sizeof(ILIdx), count, l_ifp)) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read the cache index");
+        return CE_Failure;
+    }
+
+    // Stored tiles, in data file order
+    vector<pair<GUIntBig, size_t> > live;
+    for (size_t i = 0; i < count; i++)
+        if (net64(idx[i].size) > 0)
+            live.push_back(pair<GUIntBig, size_t>(net64(idx[i].offset), i));
+    std::sort(live.begin(), live.end());
+
+    // Process specific names, in case multiple processes compact at the same time
+    CPLString suffix = CPLOPrintf(".%d.tmp", static_cast<int>(CPLGetPID()));
+    CPLString idxfname = current.idxfname + suffix;
+    CPLString datfname = current.datfname + suffix;
+    VSILFILE *fp = VSIFOpenL(datfname, "wb");
+    if (!fp) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't create %s for compaction", datfname.c_str());
+        return CE_Failure;
+    }
+
+    CPLErr ret = CE_None;
+    void *buffer = NULL;
+    size_t bsize = 0;
+    GUIntBig end = 0; // End of the data copied
+    for (size_t k = 0; k < live.size() && ret == CE_None; k++) {
+        ILIdx &tinfo = idx[live[k].second];
+        size_t size = static_cast<size_t>(net64(tinfo.size));
+        GUIntBig target = end + spacing;
+        end = target + size;
+
+        if (size > bsize) {
+            void *nbuffer = VSIRealloc(buffer, size);
+            if (!nbuffer) {
+                CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate compaction buffer");
+                ret = CE_Failure;
+                break;
+            }
+            buffer = nbuffer;
+            bsize = size;
+        }
+
+        VSIFSeekL(l_dfp, live[k].first, SEEK_SET);
+        VSIFSeekL(fp, target, SEEK_SET);
+        if (size != VSIFReadL(buffer, 1, size, l_dfp)
+            || size != VSIFWriteL(buffer, 1, size, fp))
+            ret = CE_Failure;
+        tinfo.offset = net64(target);
+    }
+    CPLFree(buffer);
+    VSIFCloseL(fp);
+
+    if (ret == CE_None) {
+        fp = VSIFOpenL(idxfname, "wb");
+        if (!fp || count != VSIFWriteL(&idx[0], sizeof(ILIdx), count, fp))
+            ret = CE_Failure;
+        if (fp)
+            VSIFCloseL(fp);
+    }
+
+    if (ret != CE_None) {
+        VSIUnlink(datfname);
+        VSIUnlink(idxfname);
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Cache compaction failed for %s", current.datfname.c_str());
+        return ret;
+    }
+
+    // Swap both files, no other process opens them in the meantime
+    void *hLock = LockCache(true);
+    if (!hLock) {
+        VSIUnlink(datfname);
+        VSIUnlink(idxfname);
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't lock %s for compaction", current.idxfname.c_str());
+        return CE_Failure;
+    }
+
+    VSIFCloseL(ifp.FP);
+    ifp.FP = NULL;
+    VSIFCloseL(dfp.FP);
+    dfp.FP = NULL;
+
+    CPLString idxold = current.idxfname + ".old";
+    CPLString datold = current.datfname + ".old";
+    int step = 0;
+    if (0 == VSIRename(current.idxfname, idxold)) step++;
+    if (step == 1 && 0 == VSIRename(current.datfname, datold)) step++;
+    if (step == 2 && 0 == VSIRename(datfname, current.datfname)) step++;
+    if (step == 3 && 0 == VSIRename(idxfname, current.idxfname)) step++;
+
+    if (step != 4) {
+        if (step == 3)
+            VSIRename(current.datfname, datfname);
+        if (step >= 2)
+            VSIRename(datold, current.datfname);
+        if (step >= 1)
+            VSIRename(idxold, current.idxfname);
+        ret = CE_Failure;
+    }
+    UnlockCache(hLock);
+
+    VSIUnlink(datfname);
+    VSIUnlink(idxfname);
+    if (ret != CE_None) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't replace %s and %s, the cache is unchanged",
+            current.datfname.c_str(), current.idxfname.c_str());
+        return ret;
+    }
+    VSIUnlink(datold);
+    VSIUnlink(idxold);
+
+    CPLDebug("MRF_CACHE", "Compacted %s to " CPL_FRMT_GUIB " bytes\n", current.datfname.c_str(), end);
+    return CE_None;
+}
+
+// Admission sketch size, rows of 8 bit counters
+#define ADMIT_ROWS 4
+#define ADMIT_WIDTH (1 << 16)
+
+// Hash of a key for a sketch row
+static size_t AdmitHash(GUIntBig key, int row)
+{
+    key += (row + 1) * 0x9E3779B97F4A7C15ULL;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    key ^= key >> 31;
+    return row * ADMIT_WIDTH + static_cast<size_t>(key & (ADMIT_WIDTH - 1));
+}
+
+//
+// Admission policy, returns true if the tile has been requested at least CACHE_ADMIT times
+// The sketch is loaded from the .admit sidecar file when CACHE_ADMIT_PERSIST is set
+//
+bool GDALMRFDataset::AdmitTile(GUIntBig infooffset, bool count)
+{
+    if (cacheAdmit < 0)
+        cacheAdmit = source.empty() ? 0 : atoi(GetOptionValue("CACHE_ADMIT", "0"));
+    if (cacheAdmit <= 1)
+        return true;
+
+    GIntBig now = static_cast<GIntBig>(time(NULL));
+    if (admit.empty()) {
+        admit.assign(ADMIT_ROWS * ADMIT_WIDTH, 0);
+        admitAged = now;
+        if (BOOLTEST(GetOptionValue("CACHE_ADMIT_PERSIST", "FALSE"))) {
+            CPLString aname = current.idxfname + ".admit";
+            VSILFILE *fp = VSIFOpenL(aname, "rb");
+            GUInt32 aged;
+            if (fp && 1 == VSIFReadL(&aged, sizeof(aged), 1, fp)
+                && admit.size() == VSIFReadL(&admit[0], 1, admit.size(), fp))
+                admitAged = aged;
+            else
+                std::fill(admit.begin(), admit.end(), 0);
+            if (fp)
+                VSIFCloseL(fp);
+        }
+    }
+
+    // Age the counts, halving them for each window that passed
+    GIntBig window = std::max(CPLAtoGIntBig(GetOptionValue("CACHE_ADMIT_WINDOW", "3600")), GIntBig(1));
+    if (now - admitAged >= window) {
+        GIntBig periods = (now - admitAged) / window;
+        int shift = static_cast<int>(std::min(periods, GIntBig(8)));
+        for (size_t i = 0; i < admit.size(); i++)
+            admit[i] = static_cast<GByte>(admit[i] >> shift);
+        admitAged += periods * window;
+    }
+
+    // The estimate is the minimum count, increment only the minimum counters
+    GByte est = 255;
+    for (int r = 0; r < ADMIT_ROWS; r++)
+        est = std::min(est, admit[AdmitHash(infooffset, r)]);
+    if (count && est < 255) {
+        for (int r = 0; r < ADMIT_ROWS; r++) {
+            GByte &c = admit[AdmitHash(infooffset, r)];
+            if (c == est)
+                c++;
+        }
+        est++;
+    }
+
+    return est >= cacheAdmit;
+}
+
+// Save the admission sketch, if persistent
+void GDALMRFDataset::SaveAdmit()
+{
+    if (admit.empty() || !BOOLTEST(GetOptionValue("CACHE_ADMIT_PERSIST", "FALSE")))
+        return;
+
+    CPLString aname = current.idxfname + ".admit";
+    VSILFILE *fp = VSIFOpenL(aname, "wb");
+    GUInt32 aged = static_cast<GUInt32>(admitAged);
+    if (!fp || 1 != VSIFWriteL(&aged, sizeof(aged), 1, fp)
+        || admit.size() != VSIFWriteL(&admit[0], 1, admit.size(), fp))
+        CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't write admission file %s", aname.c_str());
+    if (fp)
+        VSIFCloseL(fp);
+}
+
+//
+// Start copying the source index of a cloned MRF, all of it or only some levels
+// The CLONE_INDEX option is true or a level range, as first-last
+// Only the first call starts it, the flag is checked and set under the IO lock
+//
+void GDALMRFDataset::StartCloneIndex()
+{
+    CPLMutexHolderD(IOMutex());
+    if (cloneStarted)
+        return;
+    cloneStarted = true;
+    const char *pszClone = GetOptionValue("CLONE_INDEX", NULL);
+    if (!clonedSource || !pszClone || EQUAL(pszClone, "FALSE") || EQUAL(pszClone, "OFF")
+        || EQUAL(pszClone, "NO"))
+        return;
+
+    GDALMRFDataset *pSrc = static_cast<GDALMRFDataset *>(GetSrcDS());
+    if (!pSrc || !pSrc->IdxFP())
+        return;
+
+    cloneFrom = 0;
+    cloneTo = idxSize;
+    int l0, l1;
+    GDALRasterBand *b0 = GetRasterBand(1);
+    if (2 == sscanf(pszClone, "%d-%d", &l0, &l1)) {
+        int last = b0->GetOverviewCount();
+        l0 = std::max(l0, 0);
+        if (l0 > std::min(l1, last))
+            return;
+        // Start of the first level, and of the level after the last one
+        GDALMRFRasterBand *b = static_cast<GDALMRFRasterBand *>(l0 ? b0->GetOverview(l0 - 1) : b0);
+        cloneFrom = IdxOffset(ILSize(0, 0, 0, 0, l0), b->img);
+        if (l1 < last) {
+            b = static_cast<GDALMRFRasterBand *>(b0->GetOverview(l1));
+            cloneTo = IdxOffset(ILSize(0, 0, 0, 0, l1 + 1), b->img);
+        }
+    }
+
+    cloneSrcIdx = pSrc->current.idxfname;
+
+    // Open the index before the thread starts, all the index IO is then under the lock
+    if (!IdxFP())
+        return;
+    cloneThread = CPLCreateJoinableThread(CloneIndexThread, this);
+}
+
+void GDALMRFDataset::CloneIndexThread(void *p)
+{
+    static_cast<GDALMRFDataset *>(p)->CloneIndex();
+}
+
+// Write the changed records of a block of index records, in runs of adjacent ones
+static bool WriteChanged(VSILFILE *fp, GIntBig off, const vector<ILIdx> &recs,
+                         const vector<bool> &changed, size_t n)
+{
+    for (size_t i = 0; i < n;) {
+        if (!changed[i]) {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < n && changed[j])
+            j++;
+        VSIFSeekL(fp, off + i * sizeof(ILIdx), SEEK_SET);
+        if (j - i != VSIFWriteL(&recs[i], sizeof(ILIdx), j - i, fp))
+            return false;
+        i = j;
+    }
+    return true;
+}
+
+// Copy the index range, a chunk at a time, keeping the records already present
+void GDALMRFDataset::CloneIndex()
+{
+    // Use a separate source file handle, reading doesn't need the lock
+    VSILFILE *srcfp = VSIFOpenL(cloneSrcIdx, "rb");
+    if (!srcfp)
+        return;
+
+    const size_t chunk = CLONE_CHUNK / sizeof(ILIdx);
+    vector<ILIdx> src(chunk), dst(chunk);
+    vector<bool> changed(chunk);
+    for (GIntBig off = cloneFrom; off < cloneTo && !cloneStop; off += CLONE_CHUNK) {
+        size_t n = static_cast<size_t>(std::min(GIntBig(CLONE_CHUNK), cloneTo - off)) / sizeof(ILIdx);
+        VSIFSeekL(srcfp, off, SEEK_SET);
+        if (n != VSIFReadL(&src[0], sizeof(ILIdx), n, srcfp))
+            break;
+
+        // Mark the empty records as checked, same as the on demand cloning
+        for (size_t i = 0; i < n; i++)
+            if (src[i].offset == 0 && src[i].size == 0)
+                src[i].offset = net64(1);
+
+        CPLMutexHolderD(IOMutex());
+        VSILFILE *l_ifp = IdxFP();
+        if (!l_ifp)
+            break;
+        VSIFSeekL(l_ifp, idxSize + off, SEEK_SET);
+        if (n != VSIFReadL(&dst[0], sizeof(ILIdx), n, l_ifp))
+            break;
+        for (size_t i = 0; i < n; i++) {
+            changed[i] = (dst[i].offset == 0 && dst[i].size == 0);
+            if (changed[i])
+                dst[i] = src[i];
+        }
+        if (!WriteChanged(l_ifp, idxSize + off, dst, changed, n)) {
+            CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't write to cloning MRF index");
+            break;
+        }
+    }
+
+    VSIFCloseL(srcfp);
+}
+
+//
+// Append a tile from the source data file to the local one and update the index
+// Uses sendfile, on Linux, only for local files and if the CLONE_DIRECT_COPY option is set
+//
+CPLErr GDALMRFDataset::CopyClonedTile(GDALMRFDataset *pSrc, const ILIdx &tinfo, GUIntBig infooffset)
+{
+#if defined(HAVE_SENDFILE)
+    if (copySrcFd == -2)
+        return CE_Failure;
+
+    if (copySrcFd == -1) {
+        copySrcFd = -2;
+        if (!BOOLTEST(GetOptionValue("CLONE_DIRECT_COPY", "FALSE")) || hasVersions || spacing
+            || STARTS_WITH(pSrc->current.datfname, "/vsi") || STARTS_WITH(current.datfname, "/vsi")
+            || NULL == DataFP() || GF_Write != dfp.acc)
+            return CE_Failure;
+        int sfd = open(pSrc->current.datfname, O_RDONLY);
+        int dfd = (sfd < 0) ? -1 : open(current.datfname, O_WRONLY);
+        if (dfd < 0) {
+            if (sfd >= 0)
+                close(sfd);
+            return CE_Failure;
+        }
+        copySrcFd = sfd;
+        copyDstFd = dfd;
+    }
+
+    CPLMutexHolderD(IOMutex());
+    VSILFILE *l_dfp = DataFP();
+    VSILFILE *l_ifp = IdxFP();
+    if (!l_dfp || !l_ifp)
+        return CE_Failure;
+
+    // Buffered writes have to reach the file first, then append at the end
+    VSIFFlushL(l_dfp);
+    off_t offset = lseek(copyDstFd, 0, SEEK_END);
+    off_t in_off = static_cast<off_t>(tinfo.offset);
+    size_t left = static_cast<size_t>(tinfo.size);
+    while (offset >= 0 && left > 0) {
+        ssize_t n = sendfile(copyDstFd, copySrcFd, &in_off, left);
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+
+    if (offset < 0 || left) { // Not supported, go back to the normal copy
+        if (offset >= 0 && 0 != ftruncate(copyDstFd, offset))
+            CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't truncate %s", current.datfname.c_str());
+        CloseClonedCopy();
+        copySrcFd = -2;
+        return CE_Failure;
+    }
+
+    ILIdx rec;
+    rec.offset = net64(static_cast<GUIntBig>(offset));
+    rec.size = net64(static_cast<GUIntBig>(tinfo.size));
+    VSIFSeekL(l_ifp, infooffset, SEEK_SET);
+    if (sizeof(rec) != VSIFWriteL(&rec, 1, sizeof(rec), l_ifp))
+        return CE_Failure;
+    return CE_None;
+#else
+    (void)pSrc; (void)tinfo; (void)infooffset;
+    return CE_Failure;
+#endif
+}
+
+void GDALMRFDataset::CloseClonedCopy()
+{
+#if defined(HAVE_SENDFILE)
+    if (copySrcFd >= 0)
+        close(copySrcFd);
+    if (copyDstFd >= 0)
+        close(copyDstFd);
+#endif
+    copySrcFd = copyDstFd = -1;
+}
+
+// A tile to clone, with its local index record offset
+struct CloneTile {
+    GIntBig offset;
+    GIntBig size;
+    GUIntBig infooffset;
+    bool operator<(const CloneTile &other) const { return offset < other.offset; }
+};
+
+//
+// Bulk clone, scan the index for the tiles not yet cloned, marking the empty ones as checked,
+// then copy them sorted by source offset, reading the adjacent tiles together.
+// The local index is updated as each tile is written, so it can be interrupted and resumed
+//
+CPLErr GDALMRFDataset::SyncClone(GIntBig chunk, GDALProgressFunc pfnProgress, void *pProgressData,
+                                 GIntBig *pnTiles, GIntBig *pnBytes)
+{
+    if (pnTiles) *pnTiles = 0;
+    if (pnBytes) *pnBytes = 0;
+    if (!pfnProgress)
+        pfnProgress = GDALDummyProgress;
+
+    if (!clonedSource) {
+        CPLError(CE_Failure, CPLE_AppDefined, "MRF: %s is not a cloning MRF", fname.c_str());
+        return CE_Failure;
+    }
+
+    GDALMRFDataset *pSrc = static_cast<GDALMRFDataset *>(GetSrcDS());
+    VSILFILE *l_ifp = IdxFP();
+    if (!pSrc || !l_ifp || GF_Write != ifp.acc || !DataFP() || GF_Write != dfp.acc) {
+        CPLError(CE_Failure, CPLE_AppDefined, "MRF: Can't update the cloning MRF %s", fname.c_str());
+        return CE_Failure;
+    }
+
+    VSILFILE *srcidx = VSIFOpenL(pSrc->current.idxfname, "rb");
+    VSILFILE *srcdat = VSIFOpenL(pSrc->current.datfname, "rb");
+    if (!srcidx || !srcdat) {
+        CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't open the files of the cloned MRF %s",
+            pSrc->GetFname().c_str());
+        if (srcidx) VSIFCloseL(srcidx);
+        if (srcdat) VSIFCloseL(srcdat);
+        return CE_Failure;
+    }
+
+    // Scan the source and the local index, a block at a time
+    // Also fills the copy of the source index, the same way the on demand cloning does
+    vector<CloneTile> tiles;
+    GIntBig total = 0;
+    const size_t block = CLONE_CHUNK / sizeof(ILIdx);
+    vector<ILIdx> src(block), loc(block), cpy(block);
+    vector<bool> lchanged(block), cchanged(block);
+    CPLErr ret = CE_None;
+    for (GIntBig off = 0; off < idxSize && ret == CE_None; off += CLONE_CHUNK) {
+        size_t n = static_cast<size_t>(std::min(GIntBig(CLONE_CHUNK), idxSize - off)) / sizeof(ILIdx);
+        VSIFSeekL(srcidx, off, SEEK_SET);
+        if (n != VSIFReadL(&src[0], sizeof(ILIdx), n, srcidx)) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read cloned source index");
+            ret = CE_Failure;
+            break;
+        }
+
+        CPLMutexHolderD(IOMutex());
+        VSIFSeekL(l_ifp, off, SEEK_SET);
+        size_t nl = VSIFReadL(&loc[0], sizeof(ILIdx), n, l_ifp);
+        VSIFSeekL(l_ifp, idxSize + off, SEEK_SET);
+        size_t nc = VSIFReadL(&cpy[0], sizeof(ILIdx), n, l_ifp);
+        if (nl != n || nc != n) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read cloning MRF index");
+            ret = CE_Failure;
+            break;
+        }
+
+        // Only the records changed here get written, the others might be changed meanwhile
+        std::fill(cchanged.begin(), cchanged.end(), false);
+        std::fill(lchanged.begin(), lchanged.end(), false);
+        for (size_t i = 0; i < n; i++) {
+            ILIdx s = src[i];
+            if (s.offset == 0 && s.size == 0)
+                s.offset = net64(1);
+            if (cpy[i].offset == 0 && cpy[i].size == 0) {
+                cpy[i] = s;
+                cchanged[i] = true;
+            }
+            if (loc[i].offset != 0 || loc[i].size != 0)
+                continue; // Already cloned or checked
+            if (s.size == 0) { // Nothing to copy, mark it checked
+                loc[i].offset = net64(1);
+                lchanged[i] = true;
+                continue;
+            }
+            CloneTile t = { static_cast<GIntBig>(net64(s.offset)), static_cast<GIntBig>(net64(s.size)),
+                static_cast<GUIntBig>(off + i * sizeof(ILIdx)) };
+            tiles.push_back(t);
+            total += t.size;
+        }
+
+        if (!WriteChanged(l_ifp, idxSize + off, cpy, cchanged, n)
+            || !WriteChanged(l_ifp, off, loc, lchanged, n)) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't write to cloning MRF index");
+            ret = CE_Failure;
+        }
+    }
+    VSIFCloseL(srcidx);
+
+    // Copy the tiles in source order, each read covers the tiles that fit in the chunk
+    std::sort(tiles.begin(), tiles.end());
+    chunk = std::max(chunk, GIntBig(1));
+    vector<char> buffer;
+    GIntBig done = 0;
+    if (ret == CE_None && !pfnProgress(0.0, NULL, pProgressData))
+        ret = CE_Failure;
+    for (size_t i = 0; i < tiles.size() && ret == CE_None;) {
+        size_t j = i + 1;
+        while (j < tiles.size() && tiles[j].offset + tiles[j].size - tiles[i].offset <= chunk
+            && tiles[j].offset >= tiles[j - 1].offset + tiles[j - 1].size)
+            j++;
+        GIntBig start = tiles[i].offset;
+        size_t len = static_cast<size_t>(tiles[j - 1].offset + tiles[j - 1].size - start);
+        if (buffer.size() < len)
+            buffer.resize(len);
+
+        VSIFSeekL(srcdat, start, SEEK_SET);
+        if (len != VSIFReadL(&buffer[0], 1, len, srcdat)) {
+            CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't read data from source %s",
+                pSrc->current.datfname.c_str());
+            ret = CE_Failure;
+            break;
+        }
+
+        for (; i < j && ret == CE_None; i++) {
+            ret = WriteTile(&buffer[static_cast<size_t>(tiles[i].offset - start)], tiles[i].infooffset,
+                tiles[i].size);
+            if (ret != CE_None)
+                break;
+            CacheStored(tiles[i].size);
+            done += tiles[i].size;
+            if (pnTiles) (*pnTiles)++;
+            if (pnBytes) *pnBytes += tiles[i].size;
+        }
+
+        if (ret == CE_None && !pfnProgress(total ? double(done) / total : 1.0, NULL, pProgressData)) {
+            CPLError(CE_Failure, CPLE_UserInterrupt, "MRF: Clone synchronization interrupted");
+            ret = CE_Failure;
+        }
+    }
+
+    VSIFCloseL(srcdat);
+    if (ret == CE_None)
+        pfnProgress(1.0, NULL, pProgressData);
+    return ret;
+}
+
+// Recent source failures within the process, by index file and tile offset, with their expiration time
+static CPLMutex *hFailMutex = NULL;
+static std::map<CPLString, GIntBig> failures;
+
+// The failure key, source open failures are shared by all the caches of a source
+static CPLString FailKey(const CPLString &idxfname, const CPLString &source, GUIntBig infooffset)
+{
+    if (infooffset == SOURCE_FAILURE)
+        return CPLString("source:") + source;
+    return CPLOPrintf("%s:" CPL_FRMT_GUIB, idxfname.c_str(), infooffset);
+}
+
+// Record a failure, dropping the expired ones when there are too many
+// If there are still too many, the new one is not recorded
+static void AddFailure(const CPLString &key, GIntBig expires, GIntBig now)
+{
+    if (failures.size() >= MAX_FAILURES && !failures.count(key)) {
+        for (std::map<CPLString, GIntBig>::iterator it = failures.begin(); it != failures.end();)
+            if (it->second <= now)
+                failures.erase(it++);
+            else
+                ++it;
+        if (failures.size() >= MAX_FAILURES)
+            return;
+    }
+    GIntBig &value = failures[key];
+    value = std::max(value, expires);
+}
+
+// Is the failure recorded for this key still active, removes it if expired
+static bool ActiveFailure(const CPLString &key, GIntBig now)
+{
+    std::map<CPLString, GIntBig>::iterator it = failures.find(key);
+    if (it == failures.end())
+        return false;
+    if (it->second > now)
+        return true;
+    failures.erase(it);
+    return false;
+}
+
+//
+// Did the source fail recently for this tile, or did it fail to open
+// Loads the persisted failures the first time
+//
+bool GDALMRFDataset::FetchFailed(GUIntBig infooffset)
+{
+    if (failTTL < 0)
+        failTTL = source.empty() ? 0 : std::max(atoi(GetOptionValue("FETCH_FAIL_TTL", "0")), 0);
+    if (!failTTL)
+        return false;
+
+    GIntBig now = static_cast<GIntBig>(time(NULL));
+    CPLMutexHolderD(&hFailMutex);
+    if (!failLoaded) {
+        failLoaded = true;
+        VSILFILE *fp = BOOLTEST(GetOptionValue("FETCH_FAIL_PERSIST", "FALSE")) ?
+            VSIFOpenL(CPLString(current.idxfname + ".fail"), "rb") : NULL;
+        GUIntBig rec[2]; // Offset and expiration time
+        while (fp && 1 == VSIFReadL(rec, sizeof(rec), 1, fp))
+            if (static_cast<GIntBig>(rec[1]) > now)
+                AddFailure(FailKey(current.idxfname, source, rec[0]), static_cast<GIntBig>(rec[1]), now);
+        if (fp)
+            VSIFCloseL(fp);
+    }
+
+    return ActiveFailure(FailKey(current.idxfname, source, SOURCE_FAILURE), now)
+        || (infooffset != SOURCE_FAILURE && ActiveFailure(FailKey(current.idxfname, source, infooffset), now));
+}
+
+// Record a source failure for a tile, or a source open failure
+void GDALMRFDataset::FetchFailure(GUIntBig infooffset)
+{
+    FetchFailed(infooffset); // Reads the TTL and loads the persisted failures
+    if (!failTTL)
+        return;
+
+    GIntBig now = static_cast<GIntBig>(time(NULL));
+    CPLMutexHolderD(&hFailMutex);
+    AddFailure(FailKey(current.idxfname, source, infooffset), now + failTTL, now);
+}
+
+//
+// Save the active failures of this cache, if persistent
+// The failures saved by other processes in the meantime are merged in, while holding
+// the cache lock.  The file is replaced at once, so it can be read without the lock
+//
+void GDALMRFDataset::SaveFailures()
+{
+    if (!failLoaded || !BOOLTEST(GetOptionValue("FETCH_FAIL_PERSIST", "FALSE")))
+        return;
+
+    CPLString fname = current.idxfname + ".fail";
+    CPLString tmpname = fname + CPLOPrintf(".%d.tmp", static_cast<int>(CPLGetPID()));
+    GIntBig now = static_cast<GIntBig>(time(NULL));
+    CPLString prefix = current.idxfname + ":";
+    CPLString srckey = FailKey(current.idxfname, source, SOURCE_FAILURE);
+    void *hLock = LockCache(true);
+    CPLMutexHolderD(&hFailMutex);
+
+    // Merge the ones in the file, they are in this cache
+    VSILFILE *fp = VSIFOpenL(fname, "rb");
+    GUIntBig rec[2]; // Offset and expiration time
+    while (fp && 1 == VSIFReadL(rec, sizeof(rec), 1, fp))
+        if (static_cast<GIntBig>(rec[1]) > now)
+            AddFailure(FailKey(current.idxfname, source, rec[0]), static_cast<GIntBig>(rec[1]), now);
+    if (fp)
+        VSIFCloseL(fp);
+
+    fp = VSIFOpenL(tmpname, "wb");
+    bool ok = (fp != NULL);
+    for (std::map<CPLString, GIntBig>::iterator it = failures.begin(); ok && it != failures.end(); ++it) {
+        if (it->second <= now)
+            continue;
+        rec[0] = SOURCE_FAILURE;
+        rec[1] = static_cast<GUIntBig>(it->second);
+        if (it->first != srckey && 0 == it->first.compare(0, prefix.size(), prefix))
+            rec[0] = CPLScanUIntBig(it->first.c_str() + prefix.size(), 32);
+        else if (it->first != srckey)
+            continue;
+        ok = (1 == VSIFWriteL(rec, sizeof(rec), 1, fp));
+    }
+    if (fp)
+        VSIFCloseL(fp);
+    if (!ok || 0 != VSIRename(tmpname, fname)) {
+        VSIUnlink(tmpname);
+        CPLError(CE_Warning, CPLE_FileIO, "MRF: Can't write failure file %s", fname.c_str());
+    }
+    UnlockCache(hLock);
+}
+
+//
+// Queue a fetched page to be stored by the write behind thread, starting it if needed
+// The page is copied, it holds all the bands.  A page already queued is not queued again
+//
+bool GDALMRFDataset::QueuePage(GDALMRFRasterBand *band, GUIntBig infooffset, const void *page)
+{
+    if (!wbMax) {
+        if (source.empty() || !BOOLTEST(GetOptionValue("WRITE_BEHIND", "FALSE")))
+            return false;
+        wbMax = static_cast<size_t>(std::max(atoi(GetOptionValue("WRITE_BEHIND_LIMIT", "64")), 1)) << 20;
+    }
+
+    size_t size = static_cast<size_t>(band->img.pageSizeBytes);
+    WBPage wbp = { band, infooffset, VSIMalloc(size), size };
+    if (!wbp.data)
+        return false;
+    memcpy(wbp.data, page, size);
+
+    CPLMutexHolderD(&hWBMutex);
+    if (!hWBCond)
+        hWBCond = CPLCreateCond();
+    if (!wbThread && hWBCond)
+        wbThread = CPLCreateJoinableThread(WriteBehindThread, this);
+    if (!wbThread) {
+        CPLFree(wbp.data);
+        return false;
+    }
+
+    // Wait for space in the queue, the thread makes progress on its own
+    while (!wbQueue.empty() && wbBytes + size > wbMax)
+        CPLCondWait(hWBCond, hWBMutex);
+    if (wbPages.count(infooffset)) {
+        CPLFree(wbp.data);
+        return true;
+    }
+    wbPages[infooffset] = wbp;
+    wbQueue.push_back(infooffset);
+    wbBytes += size;
+    CPLCondBroadcast(hWBCond);
+    return true;
+}
+
+bool GDALMRFDataset::PendingPage(GUIntBig infooffset, void *buffer)
+{
+    if (!wbThread)
+        return false;
+
+    CPLMutexHolderD(&hWBMutex);
+    std::map<GUIntBig, WBPage>::iterator it = wbPages.find(infooffset);
+    if (it == wbPages.end())
+        return false;
+    if (buffer)
+        memcpy(buffer, it->second.data, it->second.size);
+    return true;
+}
+
+void GDALMRFDataset::WriteBehindThread(void *p)
+{
+    static_cast<GDALMRFDataset *>(p)->WriteBehind();
+}
+
+// The write behind thread loop, stores the queued pages until stopped and the queue is empty
+void GDALMRFDataset::WriteBehind()
+{
+    CPLAcquireMutex(hWBMutex, 1000.0);
+    for (;;) {
+        while (wbQueue.empty() && !wbStop)
+            CPLCondWait(hWBCond, hWBMutex);
+        if (wbQueue.empty())
+            break;
+
+        // Keep the page pending until its index record is written, so the tile is
+        // always found either in the queue or in the cache
+        WBPage wbp = wbPages[wbQueue.front()];
+        CPLReleaseMutex(hWBMutex);
+        wbp.band->CachePage(wbp.infooffset, wbp.data);
+        CPLAcquireMutex(hWBMutex, 1000.0);
+
+        wbPages.erase(wbp.infooffset);
+        wbQueue.pop_front();
+        wbBytes -= wbp.size;
+        CPLFree(wbp.data);
+        CPLCondBroadcast(hWBCond);
+    }
+    CPLReleaseMutex(hWBMutex);
+}
+
+// Drain the queue and stop the thread
+void GDALMRFDataset::StopWriteBehind()
+{
+    if (!wbThread)
+        return;
+
+    {
+        CPLMutexHolderD(&hWBMutex);
+        wbStop = true;
+        CPLCondBroadcast(hWBCond);
+    }
+    CPLJoinThread(wbThread);
+    wbThread = NULL;
+}
+
+int GDALMRFDataset::TileCached(int nBand, int level, int x, int y)
+{
+    GDALMRFRasterBand *b = static_cast<GDALMRFRasterBand *>(GetRasterBand(nBand));
+    if (b && level > 0)
+        b = (level <= b->GetOverviewCount()) ?
+            static_cast<GDALMRFRasterBand *>(b->GetOverview(level - 1)) : NULL;
+    if (!b)
+        return -1;
+
+    const ILImage &img = b->img;
+    if (x < 0 || y < 0 || x >= img.pagecount.x || y >= img.pagecount.y)
+        return -1;
+
+    ILIdx tinfo;
+    if (CE_None != ReadTileIdx(tinfo, ILSize(x, y, 0, (nBand - 1) / img.pagesize.c, level), img))
+        return -1;
+    return (0 == tinfo.size && 0 == tinfo.offset) ? 0 : 1;
+}
+
+// The tiles to be fetched in parallel, shared by the fetch threads
+struct PrefetchList {
+    GDALMRFDataset *ds;
+    vector<pair<GDALMRFRasterBand *, ILSize> > tiles;
+    size_t next;
+    CPLMutex *hMutex;
+};
+
+//
+// Fetch the missing tiles within a read window of a caching MRF, using multiple threads
+// Errors are ignored, the tiles that are still missing get fetched by the read
+//
+void GDALMRFDataset::PrefetchTiles(int nXOff, int nYOff, int nXSize, int nYSize,
+                                   int nBandCount, int *panBandMap)
+{
+    int nThreads = std::min(atoi(GetOptionValue("PARALLEL_FETCH", "0")), MAX_FETCH_THREADS);
+    if (nThreads < 2 || clonedSource || bypass_cache || GA_Update == eAccess
+        || IdxMode() == GF_Read || nXSize <= 0 || nYSize <= 0)
+        return;
+
+    const ILImage &img = current;
+    PrefetchList list = { this, vector<pair<GDALMRFRasterBand *, ILSize> >(), 0, NULL };
+    const int cstride = img.pagesize.c;
+    for (int i = 0; i < nBandCount; i++) {
+        // With interleaved pages, every band is in the page of the first one
+        if (cstride != 1 && i > 0)
+            break;
+        GDALMRFRasterBand *band = static_cast<GDALMRFRasterBand *>(
+            GetRasterBand(cstride == 1 ? panBandMap[i] : 1));
+        int pc = (band->GetBand() - 1) / cstride;
+        for (int y = nYOff / img.pagesize.y; y <= (nYOff + nYSize - 1) / img.pagesize.y; y++)
+            for (int x = nXOff / img.pagesize.x; x <= (nXOff + nXSize - 1) / img.pagesize.x; x++) {
+                ILSize pos(x, y, 0, pc, 0);
+                ILIdx tinfo;
+                GUIntBig offset = IdxOffset(pos, img);
+                if (CE_None == ReadTileIdx(tinfo, pos, img) && 0 == tinfo.size && 0 == tinfo.offset
+                    && !PendingPage(offset, NULL) && AdmitTile(offset, false) && !FetchFailed(offset))
+                    list.tiles.push_back(std::make_pair(band, pos));
+            }
+    }
+
+    if (list.tiles.size() < 2)
+        return;
+
+    nThreads = std::min(nThreads, static_cast<int>(list.tiles.size()));
+    CPLDebug("MRF_IO", "Fetching %d tiles in %d threads\n", static_cast<int>(list.tiles.size()), nThreads);
+    // Settings read by the fetch threads, initialize them before starting
+    CacheMaxSize();
+    FetchFailed(SOURCE_FAILURE);
+    vector<CPLJoinableThread *> threads;
+    for (int i = 0; i < nThreads; i++) {
+        CPLJoinableThread *t = CPLCreateJoinableThread(PrefetchThread, &list);
+        if (t)
+            threads.push_back(t);
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        CPLJoinThread(threads[i]);
+
+    if (list.hMutex)
+        CPLDestroyMutex(list.hMutex);
+}
+
+//
+// Source dataset instances for the fetch threads, since GDAL datasets are not thread safe
+// They are kept open for the life of the MRF, so they are reused by the next reads
+//
+GDALDataset *GDALMRFDataset::TakeSrcDS()
+{
+    {
+        CPLMutexHolderD(&hSrcPoolMutex);
+        if (!srcPool.empty()) {
+            GDALDataset *poDS = srcPool.back();
+            srcPool.pop_back();
+            return poDS;
+        }
+    }
+    return OpenSrcDS(false);
+}
+
+void GDALMRFDataset::ReturnSrcDS(GDALDataset *poDS)
+{
+    CPLMutexHolderD(&hSrcPoolMutex);
+    srcPool.push_back(poDS);
+}
+
+void GDALMRFDataset::CloseSrcPool()
+{
+    for (size_t i = 0; i < srcPool.size(); i++)
+        GDALClose(srcPool[i]);
+    srcPool.clear();
+    if (hSrcPoolMutex)
+        CPLDestroyMutex(hSrcPoolMutex);
+    hSrcPoolMutex = NULL;
+}
+
+void GDALMRFDataset::PrefetchThread(void *p)
+{
+    PrefetchList *list = static_cast<PrefetchList *>(p);
+    GDALMRFDataset *ds = list->ds;
+
+    GDALDataset *poSrcDS = ds->TakeSrcDS();
+    if (!poSrcDS) {
+        ds->FetchFailure(SOURCE_FAILURE);
+        return;
+    }
+    void *page = VSIMalloc(static_cast<size_t>(ds->current.pageSizeBytes));
+
+    while (page) {
+        size_t i;
+        {
+            CPLMutexHolderD(&list->hMutex);
+            i = list->next++;
+        }
+        if (i >= list->tiles.size())
+            break;
+
+        // Same as the region fetch, only if nobody else is fetching it and still missing
+        GDALMRFRasterBand *band = list->tiles[i].first;
+        const ILSize &pos = list->tiles[i].second;
+        GUIntBig offset = IdxOffset(pos, band->img);
+        if (!ds->ClaimFetch(offset, false))
+            continue;
+        void *hLock = NULL;
+        ILIdx tinfo;
+        if (ds->LockFetch(offset, &hLock, false)
+            && CE_None == ds->ReadTileIdx(tinfo, pos, band->img)
+            && 0 == tinfo.size && 0 == tinfo.offset) {
+            if (CE_None != band->ReadSource(poSrcDS, pos.x, pos.y, 1, 1, page))
+                ds->FetchFailure(offset);
+            else if (!ds->QueuePage(band, offset, page))
+                band->CachePage(offset, page);
+        }
+        GDALMRFDataset::UnlockFetch(hLock);
+        ds->ReleaseFetch(offset);
+    }
+
+    CPLFree(page);
+    ds->ReturnSrcDS(poSrcDS);
+}
+
+NAMESPACE_MRF_END
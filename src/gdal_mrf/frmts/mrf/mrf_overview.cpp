@@ -27,6 +27,9 @@
 
 #include "marfa.h"
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 CPL_CVSID("$Id: mrf_overview.cpp 35929 2016-10-25 16:09:00Z goatbar $");
 
@@ -240,6 +243,924 @@ template<> void AverageByFour<double>(double *buff, int xsz, int ysz, double ndv
     }
 }
 
+//
+// Pick the most frequent of n values, ties go to the first one
+//
+template<typename T> static T Majority(const T *v, int n) {
+    int best = 0, bcount = 0;
+    for (int i = 0; i < n; i++) {
+        int count = 0;
+        for (int j = i; j < n; j++)
+            if (v[j] == v[i])
+                count++;
+        if (count > bcount) {
+            best = i;
+            bcount = count;
+        }
+    }
+    return v[best];
+}
+
+//
+// Scales by 2x2 a buffer in place, using the majority (mode) of the four values
+// Suitable for categorical data
+//
+template<typename T> static void ModeByFour(T *buff, int xsz, int ysz) {
+    T *obuff = buff;
+    T *evenline = buff;
+
+    for (int line = 0; line < ysz; line++) {
+        T *oddline = evenline + xsz * 2;
+        for (int col = 0; col < xsz; col++) {
+            T v[4] = { evenline[0], evenline[1], oddline[0], oddline[1] };
+            *obuff++ = Majority(v, 4);
+            evenline += 2; oddline += 2;
+        }
+        evenline += xsz * 2;  // Skips the other input line
+    }
+}
+
+//
+// Same, ignoring the NoData values
+//
+template<typename T> static void ModeByFour(T *buff, int xsz, int ysz, T ndv) {
+    T *obuff = buff;
+    T *evenline = buff;
+
+    for (int line = 0; line < ysz; line++) {
+        T *oddline = evenline + xsz * 2;
+        for (int col = 0; col < xsz; col++) {
+            T v[4];
+            int n = 0;
+            if (evenline[0] != ndv) v[n++] = evenline[0];
+            if (evenline[1] != ndv) v[n++] = evenline[1];
+            if (oddline[0] != ndv) v[n++] = oddline[0];
+            if (oddline[1] != ndv) v[n++] = oddline[1];
+            *obuff++ = n ? Majority(v, n) : ndv;
+            evenline += 2; oddline += 2;
+        }
+        evenline += xsz * 2;  // Skips the other input line
+    }
+}
+
+//
+// Separable 2x decimation kernels.  The taps cover the 2x2 input block and a halo
+// of taps/2 - 1 pixels on each side, read from the neighbouring pages
+// Linear is the 2x stretched triangle, which is also the four tap binomial (gaussian)
+// Cubic is the 2x stretched Catmull-Rom, with negative lobes
+//
+static const double k_linear[4] = { 1 / 8.0, 3 / 8.0, 3 / 8.0, 1 / 8.0 };
+static const double k_cubic[8] = { -3 / 256.0, -9 / 256.0, 29 / 256.0, 111 / 256.0,
+                                   111 / 256.0, 29 / 256.0, -9 / 256.0, -3 / 256.0 };
+
+// Halo size needed around the 2x2 input blocks by a sampling mode
+static int Halo(int sampling_mode) {
+    if (sampling_mode == SAMPLING_Linear)
+        return 1;
+    if (sampling_mode == SAMPLING_Cubic)
+        return 3;
+    return 0;
+}
+
+// Round and clamp to the output type range
+template<typename T> static T Clamp(double v) {
+    if (!std::numeric_limits<T>::is_integer)
+        return static_cast<T>(v);
+    v = floor(v + 0.5);
+    if (v < static_cast<double>(std::numeric_limits<T>::min()))
+        return std::numeric_limits<T>::min();
+    if (v > static_cast<double>(std::numeric_limits<T>::max()))
+        return std::numeric_limits<T>::max();
+    return static_cast<T>(v);
+}
+
+//
+// Filters and decimates a window with halo into a block, ww is the window line size
+// Two separate passes, horizontal into the tmp buffer, then vertical
+// tmp holds xsz * (2 * ysz + taps - 2) values
+//
+template<typename T> static void FilterByFour(const T *src, int ww, T *dst, int xsz, int ysz,
+                                              const double *k, int taps, double *tmp)
+{
+    const int wh = 2 * ysz + taps - 2;
+    for (int line = 0; line < wh; line++) {
+        const T *s = src + line * ww;
+        double *t = tmp + line * xsz;
+        for (int col = 0; col < xsz; col++, s += 2) {
+            double acc = 0;
+            for (int i = 0; i < taps; i++)
+                acc += k[i] * s[i];
+            *t++ = acc;
+        }
+    }
+
+    for (int line = 0; line < ysz; line++) {
+        const double *t = tmp + 2 * line * xsz;
+        for (int col = 0; col < xsz; col++) {
+            double acc = 0;
+            for (int i = 0; i < taps; i++)
+                acc += k[i] * t[i * xsz + col];
+            *dst++ = Clamp<T>(acc);
+        }
+    }
+}
+
+//
+// Same, ignoring the NoData values.  The output is NoData only if the whole 2x2 block is NoData
+// The weights of the valid values are normalized.  If the valid values cover less than a quarter
+// of the kernel weight, the valid values of the 2x2 block are averaged instead
+//
+template<typename T> static void FilterByFour(const T *src, int ww, T *dst, int xsz, int ysz,
+                                              const double *k, int taps, T ndv)
+{
+    const int h = taps / 2 - 1;
+    for (int line = 0; line < ysz; line++) {
+        for (int col = 0; col < xsz; col++) {
+            const T *s = src + 2 * line * ww + 2 * col;
+            const T *b = s + h * ww + h; // The 2x2 block
+            T v[4] = { b[0], b[1], b[ww], b[ww + 1] };
+            int count = 0;
+            double bacc = 0;
+            for (int i = 0; i < 4; i++)
+                if (v[i] != ndv) {
+                    bacc += v[i];
+                    count++;
+                }
+
+            if (0 == count) {
+                *dst++ = ndv;
+                continue;
+            }
+
+            double acc = 0, wsum = 0;
+            for (int j = 0; j < taps; j++, s += ww)
+                for (int i = 0; i < taps; i++)
+                    if (s[i] != ndv) {
+                        acc += k[j] * k[i] * s[i];
+                        wsum += k[j] * k[i];
+                    }
+
+            *dst++ = Clamp<T>((wsum > 0.25) ? acc / wsum : bacc / count);
+        }
+    }
+}
+
+//
+// Reduces a 2x2 block buffer of one band in place, using the sampling mode
+// The output block is at the start of the buffer
+//
+static void Reduce(GDALMRFRasterBand *bdst, void *buffer, int tsz_x, int tsz_y,
+                   int sampling_mode)
+{
+    int hasNoData = 0;
+    double ndv = bdst->GetNoDataValue(&hasNoData);
+
+    // Count the NoData values
+    int count = 0; // Assume all points are data
+    if (sampling_mode == SAMPLING_Avg) {
+
+// Dispatch based on data type
+// Use an ugly temporary macro to make it look easy
+// Runs the optimized version if the page is full with data
+#define resample(T)\
+    if (hasNoData) {\
+        count = MatchCount((T *)buffer, 4 * tsz_x * tsz_y, T(ndv));\
+        if (4 * tsz_x * tsz_y == count)\
+            bdst->FillBlock(buffer);\
+        else if (0 != count)\
+            AverageByFour((T *)buffer, tsz_x, tsz_y, T(ndv));\
+        }\
+    if (0 == count)\
+        AverageByFour((T *)buffer, tsz_x, tsz_y);\
+    break;
+
+        switch (bdst->GetRasterDataType()) {
+        case GDT_Byte:      resample(GByte);
+        case GDT_UInt16:    resample(GUInt16);
+        case GDT_Int16:     resample(GInt16);
+        case GDT_UInt32:    resample(GUInt32);
+        case GDT_Int32:     resample(GInt32);
+        case GDT_Float32:   resample(float);
+        case GDT_Float64:   resample(double);
+        default: CPLAssert(false); break;
+        }
+#undef resample
+    }
+    else if (sampling_mode == SAMPLING_Near) {
+
+#define resample(T)\
+    if (hasNoData) {\
+        count = MatchCount((T *)buffer, 4 * tsz_x * tsz_y, T(ndv));\
+        if (4 * tsz_x * tsz_y == count)\
+            bdst->FillBlock(buffer);\
+        else if (0 != count)\
+            NearByFour((T *)buffer, tsz_x, tsz_y, T(ndv));\
+        }\
+    if (0 == count)\
+        NearByFour((T *)buffer, tsz_x, tsz_y);\
+    break;
+        switch (bdst->GetRasterDataType()) {
+        case GDT_Byte:      resample(GByte);
+        case GDT_UInt16:    resample(GUInt16);
+        case GDT_Int16:     resample(GInt16);
+        case GDT_UInt32:    resample(GUInt32);
+        case GDT_Int32:     resample(GInt32);
+        case GDT_Float32:   resample(float);
+        case GDT_Float64:   resample(double);
+        default: CPLAssert(false); break;
+        }
+#undef resample
+    }
+    else if (sampling_mode == SAMPLING_Mode) {
+
+#define resample(T)\
+    if (hasNoData) {\
+        count = MatchCount((T *)buffer, 4 * tsz_x * tsz_y, T(ndv));\
+        if (4 * tsz_x * tsz_y == count)\
+            bdst->FillBlock(buffer);\
+        else if (0 != count)\
+            ModeByFour((T *)buffer, tsz_x, tsz_y, T(ndv));\
+        }\
+    if (0 == count)\
+        ModeByFour((T *)buffer, tsz_x, tsz_y);\
+    break;
+        switch (bdst->GetRasterDataType()) {
+        case GDT_Byte:      resample(GByte);
+        case GDT_UInt16:    resample(GUInt16);
+        case GDT_Int16:     resample(GInt16);
+        case GDT_UInt32:    resample(GUInt32);
+        case GDT_Int32:     resample(GInt32);
+        case GDT_Float32:   resample(float);
+        case GDT_Float64:   resample(double);
+        default: CPLAssert(false); break;
+        }
+#undef resample
+    }
+}
+
+//
+// Filters a window with halo of one band into a block, for the sampling modes which need a halo
+// ww is the window line size, tmp is a scratch buffer for the separable filter
+//
+static void Filter(GDALMRFRasterBand *bdst, const void *src, int ww, void *dst,
+                   int tsz_x, int tsz_y, int sampling_mode, double *tmp)
+{
+    int hasNoData = 0;
+    double ndv = bdst->GetNoDataValue(&hasNoData);
+    const double *k = (sampling_mode == SAMPLING_Cubic) ? k_cubic : k_linear;
+    int taps = 2 * Halo(sampling_mode) + 2;
+
+#define filter(T)\
+    if (hasNoData)\
+        FilterByFour((const T *)src, ww, (T *)dst, tsz_x, tsz_y, k, taps, T(ndv));\
+    else\
+        FilterByFour((const T *)src, ww, (T *)dst, tsz_x, tsz_y, k, taps, tmp);\
+    break;
+
+    switch (bdst->GetRasterDataType()) {
+    case GDT_Byte:      filter(GByte);
+    case GDT_UInt16:    filter(GUInt16);
+    case GDT_Int16:     filter(GInt16);
+    case GDT_UInt32:    filter(GUInt32);
+    case GDT_Int32:     filter(GInt32);
+    case GDT_Float32:   filter(float);
+    case GDT_Float64:   filter(double);
+    default: CPLAssert(false); break;
+    }
+#undef filter
+}
+
+//
+// Copy a w by h area of band c from a pixel interleaved page to a band buffer
+// with a different line size. Only the value size matters, not the type itself
+//
+template<typename T> static void PageToBand(T *dst, const T *src, int c, int cstride,
+                                            int w, int h, int src_line, int dst_line)
+{
+    for (int y = 0; y < h; y++) {
+        const T *s = src + y * src_line * cstride + c;
+        T *d = dst + y * dst_line;
+        for (int x = 0; x < w; x++, s += cstride)
+            *d++ = *s;
+    }
+}
+
+// Interleave a full block from a band buffer into a page
+template<typename T> static void BandToPage(T *dst, const T *src, int c, int cstride, int sz)
+{
+    dst += c;
+    for (int i = 0; i < sz; i++, dst += cstride)
+        *dst = *src++;
+}
+
+static void PageToBand(int vsz, void *dst, const void *src, int c, int cstride,
+                       int w, int h, int src_line, int dst_line)
+{
+    switch (vsz) {
+    case 1: PageToBand((GByte *)dst, (const GByte *)src, c, cstride, w, h, src_line, dst_line); break;
+    case 2: PageToBand((GInt16 *)dst, (const GInt16 *)src, c, cstride, w, h, src_line, dst_line); break;
+    case 4: PageToBand((GInt32 *)dst, (const GInt32 *)src, c, cstride, w, h, src_line, dst_line); break;
+    case 8: PageToBand((GIntBig *)dst, (const GIntBig *)src, c, cstride, w, h, src_line, dst_line); break;
+    default: CPLAssert(false); break;
+    }
+}
+
+static void BandToPage(int vsz, void *dst, const void *src, int c, int cstride, int sz)
+{
+    switch (vsz) {
+    case 1: BandToPage((GByte *)dst, (const GByte *)src, c, cstride, sz); break;
+    case 2: BandToPage((GInt16 *)dst, (const GInt16 *)src, c, cstride, sz); break;
+    case 4: BandToPage((GInt32 *)dst, (const GInt32 *)src, c, cstride, sz); break;
+    case 8: BandToPage((GIntBig *)dst, (const GIntBig *)src, c, cstride, sz); break;
+    default: CPLAssert(false); break;
+    }
+}
+
+//
+// Averages by 2x2 a pixel interleaved buffer in place, xsz and ysz are the output size
+// The output lines are shorter, so it is written ahead of the input being read
+//
+template<typename T> static void HalveInPlace(T *buff, int xsz, int ysz, int cstride)
+{
+    T *obuff = buff;
+    for (int y = 0; y < ysz; y++) {
+        const T *evenline = buff + size_t(2 * y) * 2 * xsz * cstride;
+        const T *oddline = evenline + size_t(2) * xsz * cstride;
+        for (int x = 0; x < xsz; x++, evenline += 2 * cstride, oddline += 2 * cstride)
+            for (int c = 0; c < cstride; c++)
+                *obuff++ = Clamp<T>((double(evenline[c]) + evenline[c + cstride]
+                    + oddline[c] + oddline[c + cstride]) / 4);
+    }
+}
+
+static void HalveInPlace(GDALDataType dt, void *buff, int xsz, int ysz, int cstride)
+{
+    switch (dt) {
+    case GDT_Byte:      HalveInPlace((GByte *)buff, xsz, ysz, cstride); break;
+    case GDT_UInt16:    HalveInPlace((GUInt16 *)buff, xsz, ysz, cstride); break;
+    case GDT_Int16:     HalveInPlace((GInt16 *)buff, xsz, ysz, cstride); break;
+    case GDT_UInt32:    HalveInPlace((GUInt32 *)buff, xsz, ysz, cstride); break;
+    case GDT_Int32:     HalveInPlace((GInt32 *)buff, xsz, ysz, cstride); break;
+    case GDT_Float32:   HalveInPlace((float *)buff, xsz, ysz, cstride); break;
+    case GDT_Float64:   HalveInPlace((double *)buff, xsz, ysz, cstride); break;
+    default: CPLAssert(false); break;
+    }
+}
+
+// A decoded source page, kept while the next output tile might need it
+struct PageSlot {
+    int x, y;
+    ILIdx tinfo;
+    void *data;     // NULL until decoded
+};
+
+static PageSlot *FindSlot(vector<PageSlot> &cache, int x, int y) {
+    for (size_t i = 0; i < cache.size(); i++)
+        if (cache[i].x == x && cache[i].y == y)
+            return &cache[i];
+    return NULL;
+}
+
+// Drop the slots left of column x, keeping the decoding buffers for reuse
+static void EvictSlots(vector<PageSlot> &cache, vector<void *> &spare, int x) {
+    for (size_t i = 0; i < cache.size();) {
+        if (cache[i].x >= x) {
+            i++;
+            continue;
+        }
+        if (cache[i].data)
+            spare.push_back(cache[i].data);
+        cache.erase(cache.begin() + i);
+    }
+}
+
+//
+// Replicate the edge values of the valid area [x0, x1) by [y0, y1) to the rest of the window
+//
+static void Replicate(char *buf, int vsz, int ww, int wh, int x0, int x1, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        char *line = buf + size_t(y) * ww * vsz;
+        for (int x = 0; x < x0; x++)
+            memcpy(line + x * vsz, line + x0 * vsz, vsz);
+        for (int x = x1; x < ww; x++)
+            memcpy(line + x * vsz, line + (x1 - 1) * vsz, vsz);
+    }
+    for (int y = 0; y < y0; y++)
+        memcpy(buf + size_t(y) * ww * vsz, buf + size_t(y0) * ww * vsz, ww * vsz);
+    for (int y = y1; y < wh; y++)
+        memcpy(buf + size_t(y) * ww * vsz, buf + size_t(y1 - 1) * ww * vsz, ww * vsz);
+}
+
+/*
+ *\brief Builds the overview pages for the selected area, working directly on pages
+ * Arguments are in blocks in the output level.
+ * Each source page is read and decoded once, for all the bands it holds, then all the
+ * bands are reduced and the output page is encoded once.  The block cache is not used,
+ * so it has to be flushed before and after
+ *
+ * The filtering modes also need a halo around the 2x2 input pages.  The decoded pages are kept
+ * while the next output tile on the same row uses them, and the bottom lines of each window
+ * are saved for the next row, so only the page row under the window gets decoded twice
+ */
+
+CPLErr GDALMRFDataset::PatchPages(int BlockXOut, int BlockYOut,
+                                  int WidthOut, int HeightOut,
+                                  int srcLevel, int sampling_mode)
+{
+    int bands = GetRasterCount();
+
+    // Build a vector of input and output bands
+    vector<GDALMRFRasterBand *> src_b;
+    vector<GDALMRFRasterBand *> dst_b;
+
+    for (int band = 1; band <= bands; band++) {
+        GDALRasterBand *b = GetRasterBand(band);
+        src_b.push_back(static_cast<GDALMRFRasterBand *>((srcLevel == 0) ? b : b->GetOverview(srcLevel - 1)));
+        dst_b.push_back(static_cast<GDALMRFRasterBand *>(b->GetOverview(srcLevel)));
+    }
+
+    const ILImage &simg = src_b[0]->img;
+    const ILImage &dimg = dst_b[0]->img;
+    const int cstride = simg.pagesize.c; // Same for all levels
+    const int tsz_x = simg.pagesize.x;
+    const int tsz_y = simg.pagesize.y;
+    const GDALDataType dt = src_b[0]->GetRasterDataType();
+    const int vsz = GDALGetDataTypeSize(dt) / 8;
+    const size_t bsb = src_b[0]->blockSizeBytes();
+
+    // Levels are built from every third level, using the 1/2, 1/4 and 1/8 scaled decoding
+    // Use averaging if the format can't do it or the page size doesn't allow it
+    // This builds a single level, see DCTGroupSize for building up to three in one pass
+    if (sampling_mode == SAMPLING_DCT) {
+        int k = srcLevel % 3 + 1;
+        if (src_b[0]->CanDecompressReduced() && 0 == tsz_x % (1 << k) && 0 == tsz_y % (1 << k))
+            return PatchPagesDCT(BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel + 1 - k, k, k);
+        sampling_mode = SAMPLING_Avg;
+    }
+
+    // The input window for one band is the 2x2 block with the halo around it
+    const int h = Halo(sampling_mode);
+    const int ww = 2 * tsz_x + 2 * h;
+    const int wh = 2 * tsz_y + 2 * h;
+    const size_t wsz = size_t(ww) * wh * vsz;
+
+    // Saved bottom lines of the windows, for the next row, and the line size
+    const int sw = 2 * WidthOut * tsz_x + 2 * h;
+    const size_t ssz = size_t(sw) * h * vsz;
+
+    // Input windows for all the bands in a page and the output page
+    void *bbuff = VSIMalloc(wsz * cstride);
+    void *opage = VSIMalloc(dimg.pageSizeBytes);
+    // Output block and filter scratch buffer, when filtering
+    void *obuff = h ? VSIMalloc(bsb) : NULL;
+    double *tmp = h ? static_cast<double *>(VSIMalloc(sizeof(double) * tsz_x * wh)) : NULL;
+    char *strip = h ? static_cast<char *>(VSIMalloc(ssz * cstride)) : NULL;
+    char *nstrip = h ? static_cast<char *>(VSIMalloc(ssz * cstride)) : NULL;
+
+    if (!bbuff || !opage || (h && (!obuff || !tmp || !strip || !nstrip))) {
+        CPLFree(bbuff);
+        CPLFree(opage);
+        CPLFree(obuff);
+        CPLFree(tmp);
+        CPLFree(strip);
+        CPLFree(nstrip);
+        CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate overview buffers");
+        return CE_Failure;
+    }
+
+    // Is the saved strip valid for each output column
+    vector<char> valid(WidthOut), nvalid(WidthOut);
+    vector<PageSlot> cache;
+    vector<void *> spare;
+
+    CPLErr ret = CE_None;
+    for (int pc = 0; pc < simg.pagecount.c && ret == CE_None; pc++) {
+        int band0 = pc * cstride; // First band in this page
+        int nb = std::min(cstride, bands - band0);
+        std::fill(nvalid.begin(), nvalid.end(), 0);
+
+        for (int y = 0; y < HeightOut && ret == CE_None; y++) {
+            int dst_y = BlockYOut + y;
+            if (dst_y >= dimg.pagecount.y)
+                break;
+
+            // New row, the saved strip is now the current one
+            std::swap(strip, nstrip);
+            valid.swap(nvalid);
+            std::fill(nvalid.begin(), nvalid.end(), 0);
+            EvictSlots(cache, spare, INT_MAX);
+
+            for (int x = 0; x < WidthOut && ret == CE_None; x++) {
+                int dst_x = BlockXOut + x;
+                if (dst_x >= dimg.pagecount.x)
+                    break;
+
+                // Window origin in the input level
+                int ox = 2 * dst_x * tsz_x - h;
+                int oy = 2 * dst_y * tsz_y - h;
+
+                // Pages to the left are not needed anymore
+                EvictSlots(cache, spare, 2 * dst_x - (h ? 1 : 0));
+
+                // Range of input pages covered by the window, including the halo
+                // The top halo comes from the saved strip, when valid
+                int sx0 = std::max(0, 2 * dst_x - (h ? 1 : 0));
+                int sx1 = std::min(simg.pagecount.x, 2 * dst_x + 2 + (h ? 1 : 0));
+                int sy0 = std::max(0, 2 * dst_y - ((h && !valid[x]) ? 1 : 0));
+                int sy1 = std::min(simg.pagecount.y, 2 * dst_y + 2 + (h ? 1 : 0));
+
+                // Index records of the covered pages
+                GIntBig csize = 0; // Size of the central 2x2 pages
+                bool partial = false;
+                for (int sy = sy0; sy < sy1 && ret == CE_None; sy++)
+                    for (int sx = sx0; sx < sx1 && ret == CE_None; sx++) {
+                        PageSlot *slot = FindSlot(cache, sx, sy);
+                        if (!slot) {
+                            PageSlot ns;
+                            ns.x = sx;
+                            ns.y = sy;
+                            ns.data = NULL;
+                            ret = ReadTileIdx(ns.tinfo, ILSize(sx, sy, 0, pc, srcLevel), simg);
+                            cache.push_back(ns);
+                            slot = &cache.back();
+                        }
+                        if (sx >> 1 == dst_x && sy >> 1 == dst_y) {
+                            csize += slot->tinfo.size;
+                            if (slot->tinfo.size == 0)
+                                partial = true;
+                        }
+                    }
+                if (ret != CE_None)
+                    break;
+
+                // All the central inputs are empty, so is the output, no need to read or scan anything
+                // Only write the output index record if it is not already empty
+                if (0 == csize) {
+                    ILSize dpos(dst_x, dst_y, 0, pc, srcLevel + 1);
+                    ILIdx dinfo;
+                    ret = ReadTileIdx(dinfo, dpos, dimg);
+                    if (ret == CE_None && dinfo.size != 0)
+                        ret = WriteTile(NULL, IdxOffset(dpos, dimg), 0);
+                    continue;
+                }
+
+                // Clipped by the image size
+                if (ox + ww > simg.size.x || oy + wh > simg.size.y || sx1 - sx0 < 2 || sy1 - sy0 < 2)
+                    partial = true;
+
+                // Fill with no data where the input doesn't cover the window
+                if (partial || h)
+                    for (int c = 0; c < nb; c++) {
+                        int hasNoData = 0;
+                        double ndv = src_b[band0 + c]->GetNoDataValue(&hasNoData);
+                        if (!hasNoData)
+                            ndv = 0.0;
+                        GDALCopyWords(&ndv, GDT_Float64, 0, static_cast<char *>(bbuff) + c * wsz,
+                            dt, vsz, ww * wh);
+                    }
+
+                // Read each input page once, distribute the bands
+                for (size_t i = 0; i < cache.size() && ret == CE_None; i++) {
+                    PageSlot &slot = cache[i];
+                    if (slot.tinfo.size == 0 || slot.x < sx0 || slot.x >= sx1
+                        || slot.y < sy0 || slot.y >= sy1)
+                        continue;
+
+                    if (!slot.data) {
+                        if (!spare.empty()) {
+                            slot.data = spare.back();
+                            spare.pop_back();
+                        }
+                        else
+                            slot.data = VSIMalloc(simg.pageSizeBytes);
+                        if (!slot.data) {
+                            CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate overview buffers");
+                            ret = CE_Failure;
+                            break;
+                        }
+                        ret = src_b[band0]->ReadPage(slot.tinfo, slot.data);
+                        if (ret != CE_None)
+                            break;
+                    }
+
+                    // Part of the page inside the window and the image, in input level pixels
+                    int px0 = std::max(slot.x * tsz_x, ox);
+                    int px1 = std::min(std::min((slot.x + 1) * tsz_x, simg.size.x), ox + ww);
+                    int py0 = std::max(slot.y * tsz_y, oy);
+                    int py1 = std::min(std::min((slot.y + 1) * tsz_y, simg.size.y), oy + wh);
+                    if (px1 <= px0 || py1 <= py0)
+                        continue;
+
+                    const char *src = static_cast<char *>(slot.data)
+                        + (size_t(py0 - slot.y * tsz_y) * tsz_x + (px0 - slot.x * tsz_x)) * cstride * vsz;
+                    for (int c = 0; c < nb; c++) {
+                        char *d = static_cast<char *>(bbuff) + c * wsz
+                            + (size_t(py0 - oy) * ww + (px0 - ox)) * vsz;
+                        PageToBand(vsz, d, src, c, cstride, px1 - px0, py1 - py0, tsz_x, ww);
+                    }
+                }
+                if (ret != CE_None)
+                    break;
+
+                if (h) {
+                    for (int c = 0; c < nb; c++) {
+                        char *win = static_cast<char *>(bbuff) + c * wsz;
+
+                        // Top halo from the previous row
+                        if (valid[x])
+                            for (int l = 0; l < h; l++)
+                                memcpy(win + size_t(l) * ww * vsz,
+                                    strip + c * ssz + (size_t(l) * sw + 2 * x * tsz_x) * vsz, ww * vsz);
+
+                        // Outside of the image, extend the edges
+                        int x0 = std::max(0, -ox), x1 = std::min(ww, simg.size.x - ox);
+                        int y0 = std::max(0, -oy), y1 = std::min(wh, simg.size.y - oy);
+                        if (x0 > 0 || y0 > 0 || x1 < ww || y1 < wh)
+                            Replicate(win, vsz, ww, wh, x0, x1, y0, y1);
+
+                        // Save the bottom lines of the 2x2 block for the next row
+                        for (int l = 0; l < h; l++)
+                            memcpy(nstrip + c * ssz + (size_t(l) * sw + 2 * x * tsz_x) * vsz,
+                                win + size_t(2 * tsz_y + l) * ww * vsz, ww * vsz);
+                    }
+                    nvalid[x] = 1;
+                }
+
+                // Reduce each band and assemble the output page
+                for (int c = 0; c < nb; c++) {
+                    char *b = static_cast<char *>(bbuff) + c * wsz;
+                    if (h) {
+                        Filter(dst_b[band0 + c], b, ww, obuff, tsz_x, tsz_y, sampling_mode, tmp);
+                        b = static_cast<char *>(obuff);
+                    }
+                    else
+                        Reduce(dst_b[band0 + c], b, tsz_x, tsz_y, sampling_mode);
+                    BandToPage(vsz, opage, b, c, cstride, tsz_x * tsz_y);
+                }
+
+                ret = dst_b[band0]->WritePage(dst_x, dst_y, opage);
+            }
+        }
+        EvictSlots(cache, spare, INT_MAX);
+    }
+
+    EvictSlots(cache, spare, INT_MAX);
+    for (size_t i = 0; i < spare.size(); i++)
+        CPLFree(spare[i]);
+
+    CPLFree(bbuff);
+    CPLFree(opage);
+    CPLFree(obuff);
+    CPLFree(tmp);
+    CPLFree(strip);
+    CPLFree(nstrip);
+    return ret;
+}
+
+/*
+ *\brief Builds the overview pages of levels baseLevel + k0 to baseLevel + k1, from the base level
+ * Arguments are in blocks at the top level, baseLevel + k1.  Each base page is read and
+ * decoded only once, at 1/2^k0 resolution, into a mosaic of the area of an output page
+ * of the top level.  The pages of level baseLevel + k0 are written from the mosaic, which is
+ * then averaged in place for each of the levels above.  For JPEG, the decoder skips most of the
+ * IDCT work, which is faster and avoids the extra rounding of building each level from the
+ * previous one.  No data values are not taken into account.
+ * With dirtyOnly, only the pages marked dirty are written, the whole top level page area is
+ * still decoded.  The block cache is not used, so it has to be flushed before and after
+ */
+
+CPLErr GDALMRFDataset::PatchPagesDCT(int BlockXOut, int BlockYOut,
+                                     int WidthOut, int HeightOut,
+                                     int baseLevel, int k0, int k1, bool dirtyOnly)
+{
+    int bands = GetRasterCount();
+    vector<GDALMRFRasterBand *> src_b;
+    for (int band = 1; band <= bands; band++) {
+        GDALRasterBand *b = GetRasterBand(band);
+        src_b.push_back(static_cast<GDALMRFRasterBand *>((baseLevel == 0) ? b : b->GetOverview(baseLevel - 1)));
+    }
+
+    const ILImage &simg = src_b[0]->img;
+    const ILImage &timg = static_cast<GDALMRFRasterBand *>(GetRasterBand(1)->GetOverview(baseLevel + k1 - 1))->img;
+    const int cstride = simg.pagesize.c;
+    const int f = 1 << k1; // Base pages per top level page, in each direction
+    const int r = 1 << k0; // Decoding scale
+    const int tsz_x = simg.pagesize.x;
+    const int tsz_y = simg.pagesize.y;
+    const int rsz_x = tsz_x / r; // Reduced page size
+    const int rsz_y = tsz_y / r;
+    const int mw = rsz_x * f; // Mosaic size, at level baseLevel + k0
+    const int mh = rsz_y * f;
+    const GDALDataType dt = src_b[0]->GetRasterDataType();
+    const int vsz = GDALGetDataTypeSize(dt) / 8;
+    const size_t psz = size_t(cstride) * vsz; // Bytes per pixel, all bands
+
+    void *rpage = VSIMalloc(simg.pageSizeBytes / (r * r));
+    void *mosaic = VSIMalloc(size_t(mw) * mh * psz);
+    void *opage = (k0 == k1) ? mosaic : VSIMalloc(simg.pageSizeBytes);
+    if (!rpage || !mosaic || !opage) {
+        CPLFree(rpage);
+        if (opage != mosaic)
+            CPLFree(opage);
+        CPLFree(mosaic);
+        CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate overview buffers");
+        return CE_Failure;
+    }
+
+    CPLErr ret = CE_None;
+    vector<ILIdx> tinfo(f * f);
+    for (int pc = 0; pc < simg.pagecount.c && ret == CE_None; pc++) {
+        int band0 = pc * cstride;
+        int nb = std::min(cstride, bands - band0);
+
+        for (int y = 0; y < HeightOut && ret == CE_None; y++) {
+            int dst_y = BlockYOut + y;
+            if (dst_y >= timg.pagecount.y)
+                break;
+
+            for (int x = 0; x < WidthOut && ret == CE_None; x++) {
+                int dst_x = BlockXOut + x;
+                if (dst_x >= timg.pagecount.x)
+                    break;
+
+                // Index records of the covered base pages, empty when outside
+                GIntBig csize = 0;
+                bool partial = false;
+                for (int j = 0; j < f && ret == CE_None; j++)
+                    for (int i = 0; i < f && ret == CE_None; i++) {
+                        ILIdx &ti = tinfo[j * f + i];
+                        int sx = dst_x * f + i, sy = dst_y * f + j;
+                        ti.offset = ti.size = 0;
+                        if (sx < simg.pagecount.x && sy < simg.pagecount.y)
+                            ret = ReadTileIdx(ti, ILSize(sx, sy, 0, pc, baseLevel), simg);
+                        csize += ti.size;
+                        if (ti.size == 0)
+                            partial = true;
+                    }
+                if (ret != CE_None)
+                    break;
+
+                if (csize && partial)
+                    for (int c = 0; c < nb; c++) {
+                        int hasNoData = 0;
+                        double ndv = src_b[band0 + c]->GetNoDataValue(&hasNoData);
+                        if (!hasNoData)
+                            ndv = 0.0;
+                        GDALCopyWords(&ndv, GDT_Float64, 0, static_cast<char *>(mosaic) + c * vsz,
+                            dt, static_cast<int>(psz), mw * mh);
+                    }
+
+                // Decode each base page at reduced resolution, into its place in the mosaic
+                for (int j = 0; j < f && ret == CE_None; j++)
+                    for (int i = 0; i < f && ret == CE_None; i++) {
+                        const ILIdx &ti = tinfo[j * f + i];
+                        if (ti.size == 0)
+                            continue;
+                        ret = src_b[band0]->ReadPage(ti, rpage, r);
+                        if (ret != CE_None)
+                            break;
+                        for (int l = 0; l < rsz_y; l++)
+                            memcpy(static_cast<char *>(mosaic) + (size_t(j * rsz_y + l) * mw + i * rsz_x) * psz,
+                                static_cast<char *>(rpage) + size_t(l) * rsz_x * psz, rsz_x * psz);
+                    }
+
+                // Write the pages of each level, halving the mosaic in between
+                for (int k = k0; k <= k1 && ret == CE_None; k++) {
+                    const int g = 1 << (k1 - k); // Output pages per side at this level
+                    const int pf = 1 << k;       // Base pages per output page, per side
+                    GDALMRFRasterBand *dst = static_cast<GDALMRFRasterBand *>(
+                        GetRasterBand(band0 + 1)->GetOverview(baseLevel + k - 1));
+                    const ILImage &dimg = dst->img;
+
+                    if (k > k0 && csize)
+                        HalveInPlace(dt, mosaic, tsz_x * g, tsz_y * g, cstride);
+
+                    for (int v = 0; v < g && ret == CE_None; v++)
+                        for (int u = 0; u < g && ret == CE_None; u++) {
+                            ILSize dpos(dst_x * g + u, dst_y * g + v, 0, pc, baseLevel + k);
+                            if (dpos.x >= dimg.pagecount.x || dpos.y >= dimg.pagecount.y
+                                || (dirtyOnly && !IsDirty(dpos.x, dpos.y, baseLevel + k)))
+                                continue;
+
+                            // Empty when none of the covered base pages exist
+                            bool empty = true;
+                            for (int j = v * pf; j < (v + 1) * pf && empty; j++)
+                                for (int i = u * pf; i < (u + 1) * pf && empty; i++)
+                                    if (tinfo[j * f + i].size)
+                                        empty = false;
+
+                            if (empty) {
+                                ILIdx dinfo;
+                                ret = ReadTileIdx(dinfo, dpos, dimg);
+                                if (ret == CE_None && dinfo.size != 0)
+                                    ret = WriteTile(NULL, IdxOffset(dpos, dimg), 0);
+                                continue;
+                            }
+
+                            if (opage != mosaic)
+                                for (int l = 0; l < tsz_y; l++)
+                                    memcpy(static_cast<char *>(opage) + size_t(l) * tsz_x * psz,
+                                        static_cast<char *>(mosaic) + (size_t(v * tsz_y + l) * tsz_x * g + u * tsz_x) * psz,
+                                        tsz_x * psz);
+                            ret = dst->WritePage(dpos.x, dpos.y, opage);
+                        }
+                }
+            }
+        }
+    }
+
+    CPLFree(rpage);
+    if (opage != mosaic)
+        CPLFree(opage);
+    CPLFree(mosaic);
+    return ret;
+}
+
+/*
+ *\brief Number of levels built in one pass by PatchPagesDCT from srcLevel, zero if it doesn't apply
+ * The groups of levels start at every third level, and are limited by the number of overviews
+ * and by the page size, which has to be divisible by the reduction factor
+ */
+
+int GDALMRFDataset::DCTGroupSize(int srcLevel, int sampling_mode)
+{
+    if (sampling_mode != SAMPLING_DCT || !source.empty() || scale != 2.0 || srcLevel % 3 != 0)
+        return 0;
+    GDALMRFRasterBand *b = static_cast<GDALMRFRasterBand *>(GetRasterBand(1));
+    if (!b->CanDecompressReduced())
+        return 0;
+    int n = std::min(3, b->GetOverviewCount() - srcLevel);
+    while (n > 1 && (b->img.pagesize.x % (1 << n) || b->img.pagesize.y % (1 << n)))
+        n--;
+    return (n > 1) ? n : 0;
+}
+
+/*
+ *\brief Builds an overview page from the level below, for the synthesis of missing tiles
+ * The input is read through the bands of the level below, one band at a time, so missing
+ * tiles at that level are also built.  Only the modes without a halo are supported.
+ * The page receives all the bands of the page, interleaved if needed
+ */
+
+CPLErr GDALMRFDataset::SynthesizePage(GDALMRFRasterBand *b, int xblk, int yblk,
+                                      void *page, int sampling_mode)
+{
+    const ILImage &dimg = b->img;
+    const int cstride = dimg.pagesize.c;
+    const int tsz_x = dimg.pagesize.x;
+    const int tsz_y = dimg.pagesize.y;
+    const GDALDataType dt = b->GetRasterDataType();
+    const int vsz = GDALGetDataTypeSize(dt) / 8;
+    const int band0 = ((b->GetBand() - 1) / cstride) * cstride;
+    const int nb = std::min(cstride, GetRasterCount() - band0);
+    const int srcLevel = b->m_l - 1;
+
+    void *buffer = VSIMalloc(size_t(4) * tsz_x * tsz_y * vsz);
+    if (!buffer) {
+        CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate synthesis buffer");
+        return CE_Failure;
+    }
+
+    // Input area, clipped to the level below
+    GDALRasterBand *s0 = GetRasterBand(1);
+    if (srcLevel)
+        s0 = s0->GetOverview(srcLevel - 1);
+    int x0 = 2 * xblk * tsz_x, y0 = 2 * yblk * tsz_y;
+    int sz_x = std::min(2 * tsz_x, s0->GetXSize() - x0);
+    int sz_y = std::min(2 * tsz_y, s0->GetYSize() - y0);
+
+    CPLErr ret = CE_None;
+    for (int c = 0; c < nb && ret == CE_None; c++) {
+        GDALRasterBand *band = GetRasterBand(band0 + c + 1);
+        GDALMRFRasterBand *bsrc = static_cast<GDALMRFRasterBand *>(srcLevel ? band->GetOverview(srcLevel - 1) : band);
+        GDALMRFRasterBand *bdst = static_cast<GDALMRFRasterBand *>(band->GetOverview(srcLevel));
+
+        if (sz_x < 2 * tsz_x || sz_y < 2 * tsz_y) { // Partial input
+            size_t bsb = bsrc->blockSizeBytes();
+            char *p = static_cast<char *>(buffer);
+            for (int i = 0; i < 4; i++)
+                bsrc->FillBlock(p + i * bsb);
+        }
+
+        if (sz_x > 0 && sz_y > 0)
+            ret = bsrc->RasterIO(GF_Read, x0, y0, sz_x, sz_y,
+                buffer, sz_x, sz_y, dt, vsz, 2 * tsz_x * vsz
+#if GDAL_VERSION_MAJOR >= 2
+                ,NULL
+#endif
+                );
+        if (ret != CE_None)
+            break;
+
+        Reduce(bdst, buffer, tsz_x, tsz_y, sampling_mode);
+        BandToPage(vsz, page, buffer, c, cstride, tsz_x * tsz_y);
+    }
+
+    CPLFree(buffer);
+    return ret;
+}
+
 /*
  *\brief Patches an overview for the selected area
  * arguments are in blocks in the source level, if toTheTop is false it only does the next level
@@ -285,6 +1206,56 @@ CPLErr GDALMRFDataset::PatchOverview(int BlockX,int BlockY,
         dst_b.push_back(GetRasterBand(band)->GetOverview(srcLevel));
     }
 
+    //
+    // Local MRFs work directly on the stored pages, all bands at once, so interleaved
+    // pages are decoded and encoded only once.  Caching MRFs need the source dataset
+    // to fill in missing input, so they go through the bands.
+    //
+    if (source.empty()) {
+        // When recursing, DCT builds up to three levels in one pass over the base pages
+        int n = recursive ? DCTGroupSize(srcLevel, sampling_mode) : 0;
+
+        // Commit any pending writes, and drop the cached blocks which get stale
+        for (int band=0; band<bands; band++) {
+            src_b[band]->FlushCache();
+            dst_b[band]->FlushCache();
+            for (int l = srcLevel + 1; l < srcLevel + n; l++)
+                GetRasterBand(band + 1)->GetOverview(l)->FlushCache();
+        }
+
+        CPLErr ret;
+        if (n) {
+            // The area on the top level of the group, rounded the same way
+            for (int l = 1; l < n; l++) {
+                WidthOut += BlockXOut & 1;
+                HeightOut += BlockYOut & 1;
+                BlockXOut /= 2;
+                BlockYOut /= 2;
+                WidthOut = WidthOut / 2 + (WidthOut & 1);
+                HeightOut = HeightOut / 2 + (HeightOut & 1);
+            }
+            ret = PatchPagesDCT(BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel, 1, n);
+        }
+        else
+            ret = PatchPages(BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel, sampling_mode);
+
+        if (ret != CE_None || !recursive)
+            return ret;
+        return PatchOverview( BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel + (n ? n : 1),
+            true, sampling_mode);
+    }
+
+    // Scaled decoding only works on pages
+    if (sampling_mode == SAMPLING_DCT)
+        sampling_mode = SAMPLING_Avg;
+
+    // The band path only handles the modes which don't need a halo
+    if (Halo(sampling_mode)) {
+        CPLError(CE_Failure, CPLE_NotSupported,
+            "MRF: This sampling mode is not supported for caching or cloned MRFs");
+        return CE_Failure;
+    }
+
     // Allocate space for four blocks
     void *buffer = CPLMalloc(buffer_size *4 );
 
@@ -329,9 +1300,6 @@ CPLErr GDALMRFDataset::PatchOverview(int BlockX,int BlockY,
                     bsrc->FillBlock(b + 3*bsb);
                 }
 
-                int hasNoData = 0;
-                double ndv = bsrc->GetNoDataValue(&hasNoData);
-
                 CPLErr eErr = bsrc->RasterIO( GF_Read,
                     src_offset_x*tsz_x, src_offset_y*tsz_y, // offset in input image
                     sz_x, sz_y, // Size in output image
@@ -348,62 +1316,7 @@ CPLErr GDALMRFDataset::PatchOverview(int BlockX,int BlockY,
                     CPLError(CE_Failure, CPLE_AppDefined, "RasterIO() failed");
                 }
 
-                // Count the NoData values
-                int count = 0; // Assume all points are data
-                if (sampling_mode == SAMPLING_Avg) {
-
-// Dispatch based on data type
-// Use an ugly temporary macro to make it look easy
-// Runs the optimized version if the page is full with data
-#define resample(T)\
-    if (hasNoData) {\
-        count = MatchCount((T *)buffer, 4 * tsz_x * tsz_y, T(ndv));\
-        if (4 * tsz_x * tsz_y == count)\
-            bdst->FillBlock(buffer);\
-        else if (0 != count)\
-            AverageByFour((T *)buffer, tsz_x, tsz_y, T(ndv));\
-        }\
-    if (0 == count)\
-        AverageByFour((T *)buffer, tsz_x, tsz_y);\
-    break;
-
-                    switch (eDataType) {
-                    case GDT_Byte:      resample(GByte);
-                    case GDT_UInt16:    resample(GUInt16);
-                    case GDT_Int16:     resample(GInt16);
-                    case GDT_UInt32:    resample(GUInt32);
-                    case GDT_Int32:     resample(GInt32);
-                    case GDT_Float32:   resample(float);
-                    case GDT_Float64:   resample(double);
-                    default: CPLAssert(false); break;
-                    }
-#undef resample
-                }
-                else if (sampling_mode == SAMPLING_Near) {
-
-#define resample(T)\
-    if (hasNoData) {\
-        count = MatchCount((T *)buffer, 4 * tsz_x * tsz_y, T(ndv));\
-        if (4 * tsz_x * tsz_y == count)\
-            bdst->FillBlock(buffer);\
-        else if (0 != count)\
-            NearByFour((T *)buffer, tsz_x, tsz_y, T(ndv));\
-        }\
-    if (0 == count)\
-        NearByFour((T *)buffer, tsz_x, tsz_y);\
-    break;
-                    switch (eDataType) {
-                    case GDT_Byte:      resample(GByte);
-                    case GDT_UInt16:    resample(GUInt16);
-                    case GDT_Int16:     resample(GInt16);
-                    case GDT_UInt32:    resample(GUInt32);
-                    case GDT_Int32:     resample(GInt32);
-                    case GDT_Float32:   resample(float);
-                    case GDT_Float64:   resample(double);
-                    default: CPLAssert(false); break;
-                    }
-#undef resample
-                }
+                Reduce(bdst, buffer, tsz_x, tsz_y, sampling_mode);
 
                 // Done filling the buffer
                 // Argh, still need to clip the output to the band size on the right and bottom
@@ -446,7 +1359,88 @@ CPLErr GDALMRFDataset::PatchOverview(int BlockX,int BlockY,
 
     if (!recursive)
         return CE_None;
-    return PatchOverview( BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel+1, true);
+    return PatchOverview( BlockXOut, BlockYOut, WidthOut, HeightOut, srcLevel+1, true,
+        sampling_mode);
+}
+
+/*
+ *\brief Regenerates the overview tiles affected by the tracked writes, level by level
+ * The parents of the dirty tiles at each level are marked dirty in turn, then patched in runs
+ * of adjacent tiles.  A level is marked clean only after its parents are regenerated, so an
+ * interrupted refresh can be restarted.  Only local MRFs with dirty tracking enabled are handled
+ */
+
+CPLErr GDALMRFDataset::RefreshOverviews(int sampling_mode)
+{
+    // Commit the pending writes first, they mark tiles dirty
+    // Only tracked for overviews with a scale of 2, see InitDirty
+    FlushCache();
+    if (!InitDirty())
+        return CE_None;
+
+    int bands = GetRasterCount();
+    GDALRasterBand *b0 = GetRasterBand(1);
+    int levels = b0->GetOverviewCount();
+
+    // With a halo, the neighbors of a parent tile also depend on a child
+    int d = Halo(sampling_mode) ? 1 : 0;
+
+    CPLErr ret = CE_None;
+    for (int l = 0; l < levels && ret == CE_None;) {
+        // DCT regenerates up to three levels in one pass over the base pages
+        int n = std::max(1, DCTGroupSize(l, sampling_mode));
+
+        // Mark the parents of the dirty tiles, through the levels of the group
+        for (int sl = l; sl < l + n; sl++) {
+            GDALMRFRasterBand *bsrc = static_cast<GDALMRFRasterBand *>(sl ? b0->GetOverview(sl - 1) : b0);
+            const ILSize spc = bsrc->img.pagecount;
+            for (int y = 0; y < spc.y; y++)
+                for (int x = 0; x < spc.x; x++) {
+                    if (!IsDirty(x, y, sl))
+                        continue;
+                    for (int py = std::max(0, y - d) / 2; py <= std::min(spc.y - 1, y + d) / 2; py++)
+                        for (int px = std::max(0, x - d) / 2; px <= std::min(spc.x - 1, x + d) / 2; px++)
+                            MarkDirty(px, py, sl + 1);
+                }
+        }
+
+        // Commit pending writes and drop the cached blocks, which get stale
+        for (int band = 1; band <= bands; band++) {
+            GDALRasterBand *b = GetRasterBand(band);
+            (l ? b->GetOverview(l - 1) : b)->FlushCache();
+            for (int sl = l; sl < l + n; sl++)
+                b->GetOverview(sl)->FlushCache();
+        }
+
+        // Patch the dirty tiles of the top level of the group, in runs of adjacent tiles
+        const ILSize dpc = static_cast<GDALMRFRasterBand *>(b0->GetOverview(l + n - 1))->img.pagecount;
+        for (int py = 0; py < dpc.y && ret == CE_None; py++)
+            for (int px = 0; px < dpc.x && ret == CE_None;) {
+                if (!IsDirty(px, py, l + n)) {
+                    px++;
+                    continue;
+                }
+                int w = 1;
+                while (px + w < dpc.x && IsDirty(px + w, py, l + n))
+                    w++;
+                if (n > 1) // Only the dirty pages of the lower levels of the group get written
+                    ret = PatchPagesDCT(px, py, w, 1, l, 1, n, true);
+                else
+                    ret = PatchPages(px, py, w, 1, l, sampling_mode);
+                px += w;
+            }
+
+        if (ret == CE_None)
+            for (int sl = l; sl < l + n; sl++)
+                ClearDirty(sl);
+        l += n;
+    }
+
+    // The top level has no parents
+    if (ret == CE_None)
+        ClearDirty(levels);
+
+    return ret;
 }
 
 NAMESPACE_MRF_END
@@ -325,6 +325,25 @@ double logbase(double val, double base) {
     return log(val) / log(base);
 }
 
+/**
+ *\brief Internal overview sampling mode from a resampling name, SAMPLING_ERR if none
+ */
+int SamplingMode(const char *pszResampling) {
+    if (EQUAL("DCT", pszResampling))
+        return SAMPLING_DCT;
+    if (EQUALN("Avg", pszResampling, 3))
+        return SAMPLING_Avg;
+    if (EQUALN("NearNb", pszResampling, 4))
+        return SAMPLING_Near;
+    if (EQUAL("Mode", pszResampling))
+        return SAMPLING_Mode;
+    if (EQUAL("Bilinear", pszResampling) || EQUAL("Gauss", pszResampling))
+        return SAMPLING_Linear;
+    if (EQUAL("Cubic", pszResampling))
+        return SAMPLING_Cubic;
+    return SAMPLING_ERR;
+}
+
 /**
  *\brief Is logbase(val, base) an integer?
  *
@@ -0,0 +1,124 @@
+/*
+* Copyright 2016 Esri
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// List the tiles that changed between two versions of a versioned MRF
+// One line per tile, with the tile position and the tile record in the newer version
+//
+
+#include <gdal.h>
+#include <cpl_string.h>
+
+// For C++ interface
+#include <gdal_priv.h>
+#include <../frmts/mrf/marfa.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+USING_NAMESPACE_MRF
+
+/************************************************************************/
+/*                               Usage()                                */
+/************************************************************************/
+
+static int Usage()
+
+{
+    printf("Usage: mrf_changes [-from <version>] [-to <version>] [--help-general] versioned_mrf\n"
+        "\n"
+        "  -from <version> : the older version, defaults to the last version kept\n"
+        "  -to <version> : the newer version, defaults to 0, the current one\n"
+        "\n"
+        "Prints level z row col band offset size for each changed tile.\n"
+        "The offset and size are those of the tile in the newer version, size zero is an empty tile.\n");
+    return 1;
+}
+
+int main(int nArgc, char **papszArgv) {
+    int vfrom = -1;
+    int vto = 0;
+    int ret = 0;
+
+    std::vector<std::string> fnames;
+
+    /* Check that we are running against at least GDAL 1.9 */
+    /* Note to developers : if using newer API, please change the requirement */
+    if (atoi(GDALVersionInfo("VERSION_NUM")) < 1900)
+    {
+        fprintf(stderr, "At least, GDAL >= 1.9.0 is required for this version of %s, "
+            "which was compiled against GDAL %s\n", papszArgv[0], GDAL_RELEASE_NAME);
+        exit(1);
+    }
+
+    GDALAllRegister();
+
+    // Pick up the GDAL options
+    nArgc = GDALGeneralCmdLineProcessor(nArgc, &papszArgv, 0);
+    if (nArgc < 1)
+        exit(-nArgc);
+
+    for (int iArg = 1; iArg < nArgc; iArg++)
+    {
+        if (EQUAL(papszArgv[iArg], "--utility_version"))
+        {
+            printf("%s was compiled against GDAL %s and is running against GDAL %s\n",
+                papszArgv[0], GDAL_RELEASE_NAME, GDALVersionInfo("RELEASE_NAME"));
+            return 0;
+        }
+
+        else if (EQUAL(papszArgv[iArg], "-from") && iArg < nArgc - 1)
+            vfrom = atoi(papszArgv[++iArg]);
+
+        else if (EQUAL(papszArgv[iArg], "-to") && iArg < nArgc - 1)
+            vto = atoi(papszArgv[++iArg]);
+
+        else fnames.push_back(papszArgv[iArg]);
+    }
+
+    if (fnames.size() != 1 || vto < 0) return Usage();
+
+    // Open the current version, it has all the others
+    GDALDataset *pDS = static_cast<GDALDataset *>(GDALOpen(fnames[0].c_str(), GA_ReadOnly));
+    if (pDS == NULL)
+        ret = 2;
+    else if (!EQUAL(pDS->GetDriver()->GetDescription(), "MRF")) {
+        CPLError(CE_Failure, CPLE_AppDefined, "%s is not MRF", fnames[0].c_str());
+        ret = 2;
+    }
+    else {
+        GDALMRFDataset *pMRF = static_cast<GDALMRFDataset *>(pDS);
+        if (vfrom < 0)
+            vfrom = pMRF->GetVersionCount();
+        vector<ILSize> tiles;
+        vector<ILIdx> records;
+        if (CE_None != pMRF->ChangedTiles(vfrom, vto, tiles, &records))
+            ret = 2;
+        for (size_t i = 0; i < tiles.size(); i++)
+            printf(CPL_FRMT_GIB " %d %d %d %d " CPL_FRMT_GIB " " CPL_FRMT_GIB "\n",
+                tiles[i].l, tiles[i].z, tiles[i].y, tiles[i].x, tiles[i].c,
+                records[i].offset, records[i].size);
+    }
+
+    if (pDS)
+        GDALClose(pDS);
+
+    // General cleanup
+    CSLDestroy(papszArgv);
+    GDALDestroyDriverManager();
+    return ret;
+}
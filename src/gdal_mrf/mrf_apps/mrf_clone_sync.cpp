@@ -0,0 +1,120 @@
+/*
+* Copyright 2016 Esri
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Bulk synchronization of a cloning MRF with its source
+// The tiles not yet cloned are copied in source data file order, in large reads
+// It can be interrupted and run again, it only copies the tiles still missing
+//
+
+#include <gdal.h>
+#include <cpl_string.h>
+
+// For C++ interface
+#include <gdal_priv.h>
+#include <../frmts/mrf/marfa.h>
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+using namespace std;
+USING_NAMESPACE_MRF
+
+/************************************************************************/
+/*                               Usage()                                */
+/************************************************************************/
+
+static int Usage()
+
+{
+    printf("Usage: mrf_clone_sync [-chunk <MB>] [-q] [--help-general] cloning_mrf\n"
+        "\n"
+        "  -chunk <MB> : maximum size of a source read, in MB (16)\n"
+        "  -q : turn off progress display\n");
+    return 1;
+}
+
+int main(int nArgc, char **papszArgv) {
+    GDALProgressFunc pfnProgress = GDALTermProgress;
+    GIntBig chunk = 16;
+    int ret = 0;
+
+    std::vector<std::string> fnames;
+
+    /* Check that we are running against at least GDAL 1.9 */
+    /* Note to developers : if using newer API, please change the requirement */
+    if (atoi(GDALVersionInfo("VERSION_NUM")) < 1900)
+    {
+        fprintf(stderr, "At least, GDAL >= 1.9.0 is required for this version of %s, "
+            "which was compiled against GDAL %s\n", papszArgv[0], GDAL_RELEASE_NAME);
+        exit(1);
+    }
+
+    GDALAllRegister();
+
+    // Pick up the GDAL options
+    nArgc = GDALGeneralCmdLineProcessor(nArgc, &papszArgv, 0);
+    if (nArgc < 1)
+        exit(-nArgc);
+
+    for (int iArg = 1; iArg < nArgc; iArg++)
+    {
+        if (EQUAL(papszArgv[iArg], "--utility_version"))
+        {
+            printf("%s was compiled against GDAL %s and is running against GDAL %s\n",
+                papszArgv[0], GDAL_RELEASE_NAME, GDALVersionInfo("RELEASE_NAME"));
+            return 0;
+        }
+
+        else if (EQUAL(papszArgv[iArg], "-chunk") && iArg < nArgc - 1)
+            chunk = strtol(papszArgv[++iArg], 0, 0);
+
+        else if (EQUAL(papszArgv[iArg], "-q") || EQUAL(papszArgv[iArg], "-quiet"))
+            pfnProgress = GDALDummyProgress;
+
+        else fnames.push_back(papszArgv[iArg]);
+    }
+
+    if (fnames.size() != 1 || chunk <= 0) return Usage();
+
+    // Cloning MRFs are opened read only, the local files get written anyhow
+    GDALDataset *pDS = static_cast<GDALDataset *>(GDALOpen(fnames[0].c_str(), GA_ReadOnly));
+    if (pDS == NULL)
+        ret = 2;
+    else if (!EQUAL(pDS->GetDriver()->GetDescription(), "MRF")) {
+        CPLError(CE_Failure, CPLE_AppDefined, "%s is not MRF", fnames[0].c_str());
+        ret = 2;
+    }
+    else {
+        GIntBig tiles, bytes;
+        time_t start = time(NULL);
+        if (CE_None != static_cast<GDALMRFDataset *>(pDS)->SyncClone(chunk * 1024 * 1024,
+            pfnProgress, NULL, &tiles, &bytes))
+            ret = 2;
+        double elapsed = difftime(time(NULL), start);
+        fprintf(stderr, "Copied " CPL_FRMT_GIB " tiles, %.1f MB in %.0f seconds, %.1f MB/s\n",
+            tiles, bytes / 1048576.0, elapsed, bytes / 1048576.0 / (elapsed > 1 ? elapsed : 1));
+    }
+
+    if (pDS)
+        GDALClose(pDS);
+
+    // General cleanup
+    CSLDestroy(papszArgv);
+    GDALDestroyDriverManager();
+    return ret;
+}
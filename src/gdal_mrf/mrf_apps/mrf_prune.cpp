@@ -0,0 +1,116 @@
+/*
+* Copyright 2016 Esri
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Drop the oldest versions of a versioned MRF and compact its data file
+//
+
+#include <gdal.h>
+#include <cpl_string.h>
+
+// For C++ interface
+#include <gdal_priv.h>
+#include <../frmts/mrf/marfa.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+USING_NAMESPACE_MRF
+
+/************************************************************************/
+/*                               Usage()                                */
+/************************************************************************/
+
+static int Usage()
+
+{
+    printf("Usage: mrf_prune -keep <versions> [-q] [--help-general] versioned_mrf\n"
+        "\n"
+        "  -keep <versions> : number of previous versions to keep, besides the current one\n"
+        "  -q : turn off progress display\n");
+    return 1;
+}
+
+int main(int nArgc, char **papszArgv) {
+    GDALProgressFunc pfnProgress = GDALTermProgress;
+    int keep = -1;
+    int ret = 0;
+
+    std::vector<std::string> fnames;
+
+    /* Check that we are running against at least GDAL 1.9 */
+    /* Note to developers : if using newer API, please change the requirement */
+    if (atoi(GDALVersionInfo("VERSION_NUM")) < 1900)
+    {
+        fprintf(stderr, "At least, GDAL >= 1.9.0 is required for this version of %s, "
+            "which was compiled against GDAL %s\n", papszArgv[0], GDAL_RELEASE_NAME);
+        exit(1);
+    }
+
+    GDALAllRegister();
+
+    // Pick up the GDAL options
+    nArgc = GDALGeneralCmdLineProcessor(nArgc, &papszArgv, 0);
+    if (nArgc < 1)
+        exit(-nArgc);
+
+    for (int iArg = 1; iArg < nArgc; iArg++)
+    {
+        if (EQUAL(papszArgv[iArg], "--utility_version"))
+        {
+            printf("%s was compiled against GDAL %s and is running against GDAL %s\n",
+                papszArgv[0], GDAL_RELEASE_NAME, GDALVersionInfo("RELEASE_NAME"));
+            return 0;
+        }
+
+        else if (EQUAL(papszArgv[iArg], "-keep") && iArg < nArgc - 1)
+            keep = atoi(papszArgv[++iArg]);
+
+        else if (EQUAL(papszArgv[iArg], "-q") || EQUAL(papszArgv[iArg], "-quiet"))
+            pfnProgress = GDALDummyProgress;
+
+        else fnames.push_back(papszArgv[iArg]);
+    }
+
+    if (fnames.size() != 1 || keep < 0) return Usage();
+
+    GDALDataset *pDS = static_cast<GDALDataset *>(GDALOpen(fnames[0].c_str(), GA_Update));
+    if (pDS == NULL)
+        ret = 2;
+    else if (!EQUAL(pDS->GetDriver()->GetDescription(), "MRF")) {
+        CPLError(CE_Failure, CPLE_AppDefined, "%s is not MRF", fnames[0].c_str());
+        ret = 2;
+    }
+    else {
+        GDALMRFDataset *pMRF = static_cast<GDALMRFDataset *>(pDS);
+        int versions = pMRF->GetVersionCount();
+        GIntBig bytes = 0;
+        if (CE_None != pMRF->PruneVersions(keep, pfnProgress, NULL, &bytes))
+            ret = 2;
+        else
+            fprintf(stderr, "Kept %d of %d versions, reclaimed %.1f MB\n",
+                pMRF->GetVersionCount(), versions, bytes / 1048576.0);
+    }
+
+    if (pDS)
+        GDALClose(pDS);
+
+    // General cleanup
+    CSLDestroy(papszArgv);
+    GDALDestroyDriverManager();
+    return ret;
+}
@@ -0,0 +1,330 @@
+/*
+* Copyright 2016 Esri
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+//
+// Prefill a caching or cloned MRF, over one or more regions and a range of levels
+// Each worker thread opens the MRF and reads the tiles which are not cached yet,
+// so they get fetched from the source and stored the same way a normal read does
+//
+
+#include "mrf_warm.h"
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+USING_NAMESPACE_MRF
+
+void state::tileDone(bool ok, bool wasFetched)
+{
+    CPLMutexHolderD(&hMutex);
+    done++;
+    if (!ok)
+        failed++;
+    else if (wasFetched)
+        fetched++;
+    Progress(double(done) / tiles.size(), NULL, NULL);
+}
+
+void state::worker(void *p)
+{
+    state *s = static_cast<state *>(p);
+
+    // Each thread uses its own dataset
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    GDALMRFDataset *ds = static_cast<GDALMRFDataset *>(GDALOpen(s->TargetName.c_str(), GA_ReadOnly));
+    CPLPopErrorHandler();
+    // The tiles left over by all the threads are counted as failed, see warm()
+    if (!ds) {
+        CPLError(CE_Failure, CPLE_AppDefined, "Can't open file %s", s->TargetName.c_str());
+        return;
+    }
+
+    GDALRasterBand *b0 = ds->GetRasterBand(1);
+    int bx, by;
+    b0->GetBlockSize(&bx, &by);
+    void *buffer = CPLMalloc(size_t(bx) * by * (GDALGetDataTypeSize(b0->GetRasterDataType()) / 8));
+
+    for (;;) {
+        size_t i;
+        {
+            CPLMutexHolderD(&s->hMutex);
+            i = s->next++;
+        }
+        if (i >= s->tiles.size())
+            break;
+
+        const Tile &t = s->tiles[i];
+        // Might have been fetched together with another tile
+        int cached = ds->TileCached(t.band, t.level, t.x, t.y);
+        bool ok = (cached == 1);
+        if (cached == 0) {
+            GDALRasterBand *b = ds->GetRasterBand(t.band);
+            if (t.level)
+                b = b->GetOverview(t.level - 1);
+            ok = (b && CE_None == b->ReadBlock(t.x, t.y, buffer));
+            if (!ok && s->verbose)
+                cerr << "Failed tile level " << t.level << " band " << t.band
+                    << " at " << t.x << "," << t.y << endl;
+        }
+        s->tileDone(ok, cached == 0);
+    }
+
+    CPLFree(buffer);
+    GDALClose(ds);
+}
+
+bool state::warm() {
+    if (TargetName.empty())
+        return false;
+
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    GDALMRFDataset *ds = static_cast<GDALMRFDataset *>(GDALOpen(TargetName.c_str(), GA_ReadOnly));
+    CPLPopErrorHandler();
+
+    if (ds == NULL) {
+        CPLError(CE_Failure, CPLE_AppDefined, "Can't open file %s", TargetName.c_str());
+        return false;
+    }
+
+    if (!EQUAL(ds->GetDriver()->GetDescription(), "MRF")) {
+        CPLError(CE_Failure, CPLE_AppDefined, "File is not MRF");
+        GDALClose(ds);
+        return false;
+    }
+
+    GDALRasterBand *b0 = ds->GetRasterBand(1);
+    int bx, by;
+    b0->GetBlockSize(&bx, &by);
+    int xsz = ds->GetRasterXSize();
+    int ysz = ds->GetRasterYSize();
+
+    // Regions in base level pixels, the whole image by default
+    vector<Window> regions;
+    if (geo) {
+        double gt[6];
+        if (CE_None != ds->GetGeoTransform(gt) || gt[1] == 0 || gt[5] == 0) {
+            CPLError(CE_Failure, CPLE_AppDefined, "File is not georeferenced, can't use bounding boxes");
+            GDALClose(ds);
+            return false;
+        }
+        for (size_t i = 0; i < windows.size(); i++) {
+            Window w;
+            w.lx = (windows[i].lx - gt[0]) / gt[1];
+            w.ux = (windows[i].ux - gt[0]) / gt[1];
+            w.ly = (windows[i].uy - gt[3]) / gt[5];
+            w.uy = (windows[i].ly - gt[3]) / gt[5];
+            if (w.lx > w.ux) swap(w.lx, w.ux);
+            if (w.ly > w.uy) swap(w.ly, w.uy);
+            regions.push_back(w);
+        }
+    }
+    for (size_t i = 0; i < tranges.size(); i++) {
+        Window w = { tranges[i].lx * bx, tranges[i].ly * by,
+            (tranges[i].ux + 1) * bx, (tranges[i].uy + 1) * by };
+        regions.push_back(w);
+    }
+    if (regions.empty()) {
+        Window w = { 0, 0, double(xsz), double(ysz) };
+        regions.push_back(w);
+    }
+
+    // Pixel interleaved pages hold all the bands, use only the first one
+    int bands = ds->GetRasterCount();
+    double tileBytes = double(bx) * by * (GDALGetDataTypeSize(b0->GetRasterDataType()) / 8);
+    const char *pszInterleave = ds->GetMetadataItem("INTERLEAVE", "IMAGE_STRUCTURE");
+    if (pszInterleave && EQUAL(pszInterleave, "PIXEL")) {
+        tileBytes *= bands;
+        bands = 1;
+    }
+
+    int last = b0->GetOverviewCount();
+    if (stop_level >= 0)
+        last = min(last, stop_level);
+
+    // Build the list of tiles not yet cached, from the top level down
+    // Tiles covered by more than one region are listed once
+    size_t skipped = 0;
+    for (int l = last; l >= start_level; l--) {
+        GDALRasterBand *lb = l ? b0->GetOverview(l - 1) : b0;
+        if (!lb)
+            continue;
+        double sx = double(xsz) / lb->GetXSize();
+        double sy = double(ysz) / lb->GetYSize();
+        int tcx = (lb->GetXSize() + bx - 1) / bx;
+        int tcy = (lb->GetYSize() + by - 1) / by;
+        vector<bool> seen(size_t(tcx) * tcy, false);
+        for (size_t r = 0; r < regions.size(); r++) {
+            int x0 = max(0, int(regions[r].lx / sx / bx));
+            int y0 = max(0, int(regions[r].ly / sy / by));
+            int x1 = min(tcx - 1, int((regions[r].ux / sx - 1) / bx));
+            int y1 = min(tcy - 1, int((regions[r].uy / sy - 1) / by));
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++) {
+                    if (seen[size_t(y) * tcx + x])
+                        continue;
+                    seen[size_t(y) * tcx + x] = true;
+                    for (int b = 1; b <= bands; b++) {
+                        int cached = ds->TileCached(b, l, x, y);
+                        if (cached < 0) {
+                            CPLError(CE_Failure, CPLE_AppDefined, "Can't read the index of %s", TargetName.c_str());
+                            GDALClose(ds);
+                            return false;
+                        }
+                        if (cached) {
+                            skipped++;
+                            continue;
+                        }
+                        Tile t = { b, l, x, y };
+                        tiles.push_back(t);
+                    }
+                }
+        }
+    }
+    GDALClose(ds);
+
+    if (verbose)
+        cerr << tiles.size() << " tiles to fetch, " << skipped << " already cached" << endl;
+
+    if (tiles.empty())
+        return true;
+
+    time_t start = time(NULL);
+    Progress(0.0, NULL, NULL);
+    int n = max(1, min(threads, int(tiles.size())));
+    vector<CPLJoinableThread *> pool;
+    for (int i = 0; i < n; i++) {
+        CPLJoinableThread *t = CPLCreateJoinableThread(worker, this);
+        if (t)
+            pool.push_back(t);
+    }
+    if (pool.empty()) // Do it in this thread
+        worker(this);
+    for (size_t i = 0; i < pool.size(); i++)
+        CPLJoinThread(pool[i]);
+
+    // Tiles not read at all, if the worker threads couldn't open the file
+    if (done < tiles.size())
+        failed += tiles.size() - done;
+
+    // Throughput in tiles and in uncompressed data
+    double elapsed = max(1.0, difftime(time(NULL), start));
+    fprintf(stderr, "Fetched %lu tiles in %.0f seconds, %.1f tiles/s, %.1f MB/s, %lu failed, %lu already cached\n",
+        (unsigned long)fetched, elapsed, fetched / elapsed, fetched * tileBytes / elapsed / (1024 * 1024),
+        (unsigned long)failed, (unsigned long)skipped);
+
+    return failed == 0;
+}
+
+/************************************************************************/
+/*                               Usage()                                */
+/************************************************************************/
+
+static int Usage()
+
+{
+    printf("Usage: mrf_warm [-bbox <lx> <ly> <ux> <uy>]* [-tiles <x0> <y0> <x1> <y1>]*\n"
+        "                [-start_level <N>] [-stop_level <N>] [-j <N>]\n"
+        "                [-q] [-v] [--help-general] mrf_file\n"
+        "\n"
+        "  -bbox : region to fetch, in georeferenced coordinates, can be repeated\n"
+        "  -tiles : region to fetch, as an inclusive range of base level tiles, can be repeated\n"
+        "  -start_level <N> : first level to fetch (0)\n"
+        "  -stop_level <N> : last level to fetch (last)\n"
+        "  -j <N> : number of tiles fetched at the same time (4)\n"
+        "  -q : turn off progress display\n"
+        "  -v : verbose\n");
+    return 1;
+}
+
+int main(int nArgc, char **papszArgv) {
+    state State;
+    int ret = 0;
+
+    std::vector<std::string> fnames;
+
+    /* Check that we are running against at least GDAL 1.9 */
+    /* Note to developers : if using newer API, please change the requirement */
+    if (atoi(GDALVersionInfo("VERSION_NUM")) < 1900)
+    {
+        fprintf(stderr, "At least, GDAL >= 1.9.0 is required for this version of %s, "
+            "which was compiled against GDAL %s\n", papszArgv[0], GDAL_RELEASE_NAME);
+        exit(1);
+    }
+
+    GDALAllRegister();
+
+    // Pick up the GDAL options
+    nArgc = GDALGeneralCmdLineProcessor(nArgc, &papszArgv, 0);
+    if (nArgc < 1)
+        exit(-nArgc);
+
+    /* -------------------------------------------------------------------- */
+    /*      Parse commandline, set up state                                 */
+    /* -------------------------------------------------------------------- */
+
+    for (int iArg = 1; iArg < nArgc; iArg++)
+    {
+        if (EQUAL(papszArgv[iArg], "--utility_version"))
+        {
+            printf("%s was compiled against GDAL %s and is running against GDAL %s\n",
+                papszArgv[0], GDAL_RELEASE_NAME, GDALVersionInfo("RELEASE_NAME"));
+            return 0;
+        }
+
+        else if ((EQUAL(papszArgv[iArg], "-bbox") || EQUAL(papszArgv[iArg], "-tiles")) && iArg < nArgc - 4) {
+            bool tiles = EQUAL(papszArgv[iArg], "-tiles");
+            Window w;
+            w.lx = CPLAtof(papszArgv[++iArg]);
+            w.ly = CPLAtof(papszArgv[++iArg]);
+            w.ux = CPLAtof(papszArgv[++iArg]);
+            w.uy = CPLAtof(papszArgv[++iArg]);
+            if (tiles)
+                State.addTiles(w);
+            else
+                State.addBBox(w);
+        }
+
+        else if (EQUAL(papszArgv[iArg], "-start_level") && iArg < nArgc - 1)
+            State.setStart(strtol(papszArgv[++iArg], 0, 0));
+
+        else if (EQUAL(papszArgv[iArg], "-stop_level") && iArg < nArgc - 1)
+            State.setStop(strtol(papszArgv[++iArg], 0, 0));
+
+        else if (EQUAL(papszArgv[iArg], "-j") && iArg < nArgc - 1)
+            State.setThreads(strtol(papszArgv[++iArg], 0, 0));
+
+        else if (EQUAL(papszArgv[iArg], "-q") || EQUAL(papszArgv[iArg], "-quiet"))
+            State.setProgress(GDALDummyProgress);
+
+        else if (EQUAL(papszArgv[iArg], "-v"))
+            State.setDebug(1);
+
+        else fnames.push_back(papszArgv[iArg]);
+    }
+
+    if (fnames.size() != 1) return Usage();
+    State.setTarget(fnames[0]);
+
+    // false return means error was detected and printed
+    if (!State.warm())
+        ret = 2;
+
+    // General cleanup
+    CSLDestroy(papszArgv);
+    GDALDestroyDriverManager();
+    return ret;
+}
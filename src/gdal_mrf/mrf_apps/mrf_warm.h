@@ -0,0 +1,102 @@
+/*
+* Copyright 2016 Esri
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <gdal.h>
+#include <cpl_string.h>
+#include <cpl_multiproc.h>
+
+// For C++ interface
+#include <gdal_priv.h>
+#include <../frmts/mrf/marfa.h>
+
+#include <vector>
+#include <string>
+
+// A region to warm, in base level pixels
+struct Window {
+    double lx, ly, ux, uy;
+};
+
+// A tile to fetch
+struct Tile {
+    int band, level, x, y;
+};
+
+class state {
+
+public:
+    state():verbose(false),
+        threads(4),
+        geo(false),
+        start_level(0), // From base
+        stop_level(-1), // To the last overview
+        Progress(GDALTermProgress),
+        next(0),
+        done(0),
+        fetched(0),
+        failed(0),
+        hMutex(NULL)
+    {};
+
+    ~state() {
+        if (hMutex)
+            CPLDestroyMutex(hMutex);
+    }
+
+    // Fetch all the tiles not yet cached
+    bool warm(void);
+
+    void setStart(int level) { start_level = level; }
+
+    void setStop(int level) { stop_level = level; }
+
+    void setThreads(int n) { threads = n; }
+
+    void setTarget(const std::string &Target) {TargetName=Target;}
+
+    // Bounding box in georeferenced coordinates
+    void addBBox(const Window &w) { windows.push_back(w); geo = true; }
+
+    // Tile range of the base level
+    void addTiles(const Window &w) { tranges.push_back(w); }
+
+    void setProgress(GDALProgressFunc pfnProgress) { Progress = pfnProgress; }
+
+    void setDebug(int level) { verbose = level; }
+
+private:
+    // Worker thread, reads tiles from the list until done
+    static void worker(void *);
+    void tileDone(bool ok, bool wasFetched);
+
+    int verbose;
+    int threads;
+    bool geo;
+    int start_level;
+    int stop_level;
+    std::string TargetName;
+    std::vector<Window> windows;
+    std::vector<Window> tranges;
+    GDALProgressFunc Progress;
+
+    // The work list and the counters, shared by the worker threads
+    std::vector<Tile> tiles;
+    size_t next;
+    size_t done;
+    size_t fetched;
+    size_t failed;
+    CPLMutex *hMutex;
+};